@@ -2,19 +2,23 @@
 
 const puppeteer = require('puppeteer');
 const path = require('path');
+const net = require('net');
+const fs = require('fs');
+const os = require('os');
 
-var argv = process.argv.slice(2);
-var svg_path = path.resolve(argv[0]);
-var png_path = argv[1];
-
-(async() => {
-
-try {
-    const browser = await puppeteer.launch({
+function launchBrowser() {
+    return puppeteer.launch({
         headless: "new",
         args: ['--no-sandbox', '--disable-setuid-sandbox']
     });
-    const page = await browser.newPage();
+}
+
+// Output path that indicates that the image should be returned instead of saved.
+const IN_MEMORY = '-';
+
+// Returns PNG data when `png_path` is `-`.
+async function render(page, svg_path, png_path, svg_width) {
+    const out_path = png_path == IN_MEMORY ? undefined : png_path;
 
     await page.goto("file://" + svg_path);
 
@@ -30,12 +34,8 @@ try {
                     || (svg_file_size[0] == null && svg_file_size[1] == null)
 
     if (is_dynamic) {
-        var svg_width;
-        if (argv[2] == undefined) {
-            console.log("Error: width argument must be set")
-            process.exit()
-        } else {
-            svg_width = parseInt(argv[2])
+        if (svg_width == undefined) {
+            throw new Error("width argument must be set")
         }
 
         var svg_view_box = await page.evaluate(() => {
@@ -48,8 +48,7 @@ try {
         });
 
         if (svg_view_box == null) {
-            console.error("Error: no viewBox")
-            process.exit(1);
+            throw new Error("no viewBox")
         }
 
         var view_size;
@@ -74,8 +73,8 @@ try {
             }
         }
 
-        await page.screenshot({
-            path: png_path,
+        return await page.screenshot({
+            path: out_path,
             clip: { x: 0, y: y, width: view_size[0], height: h },
             omitBackground: true
         });
@@ -91,8 +90,8 @@ try {
         });
 
         var svg_scale = 1
-        if (argv[2] != undefined) {
-            svg_scale = argv[2] / svg_rect[2]
+        if (svg_width != undefined) {
+            svg_scale = svg_width / svg_rect[2]
         }
 
         await page.setViewport({
@@ -101,15 +100,175 @@ try {
             deviceScaleFactor: svg_scale
         });
 
-        await page.screenshot({
-            path: png_path,
+        return await page.screenshot({
+            path: out_path,
             clip: { x: svg_rect[0], y: svg_rect[1], width: svg_rect[2], height: svg_rect[3] },
             omitBackground: true
         });
     }
+}
+
+// A fixed amount of pages shared by all connections.
+class PagePool {
+    constructor(browser, size) {
+        this.browser = browser;
+        this.size = size;
+        this.count = 0;
+        this.idle = [];
+        this.waiters = [];
+    }
+
+    async acquire() {
+        if (this.idle.length != 0) {
+            return this.idle.pop();
+        }
+
+        if (this.count < this.size) {
+            this.count++;
+            return await this.browser.newPage();
+        }
+
+        return await new Promise((resolve) => this.waiters.push(resolve));
+    }
+
+    release(page) {
+        if (this.waiters.length != 0) {
+            this.waiters.shift()(page);
+        } else {
+            this.idle.push(page);
+        }
+    }
+
+    // Closes a page that may be broken, like after a timeout or a crash,
+    // and replaces it for the next request.
+    async discard(page) {
+        try {
+            await page.close();
+        } catch (e) {
+            // The target is already gone.
+        }
+
+        this.count--;
+
+        if (this.waiters.length != 0) {
+            this.count++;
+            try {
+                this.release(await this.browser.newPage());
+            } catch (e) {
+                this.count--;
+                console.error(e);
+            }
+        }
+    }
+}
+
+// Handles a `in.svg\tout.png\twidth` request and returns a reply.
+// Paths cannot contain tabs and line breaks, like in qtsvgrender.
+//
+// When the output path is `-`, replies with `png <size>` followed by PNG data.
+//
+// Requests of a closed connection are skipped.
+async function handleRequest(pool, conn, request) {
+    const items = request.split('\t');
+    if (items.length != 3 || !/^\d+$/.test(items[2])) {
+        return ['error: Invalid request.\n'];
+    }
+
+    if (conn.destroyed) {
+        return [];
+    }
+
+    const page = await pool.acquire();
+    if (conn.destroyed) {
+        pool.release(page);
+        return [];
+    }
+
+    try {
+        const data = await render(page, path.resolve(items[0]), items[1], parseInt(items[2]));
+        pool.release(page);
+
+        if (items[1] == IN_MEMORY) {
+            return ['png ' + data.length + '\n', data];
+        }
+
+        return ['ok\n'];
+    } catch (e) {
+        // Don't let a broken page fail the following requests.
+        await pool.discard(page);
+        return ['error: ' + String(e.message || e).split('\n')[0] + '\n'];
+    }
+}
+
+// Accepts connections on a local socket. Each connection sends requests, one per line,
+// and receives a reply for each request in the same order.
+// Connections are processed concurrently using a single browser.
+//
+// Prints `ready` when the socket is ready and exits when stdin is closed.
+async function runServer(socket_path) {
+    const browser = await launchBrowser();
+    const pool = new PagePool(browser, os.cpus().length);
+
+    const server = net.createServer((conn) => {
+        var buffer = '';
+        var queue = Promise.resolve();
+
+        conn.setEncoding('utf8');
+        conn.on('data', (chunk) => {
+            buffer += chunk;
+
+            var idx;
+            while ((idx = buffer.indexOf('\n')) != -1) {
+                const line = buffer.slice(0, idx).trim();
+                buffer = buffer.slice(idx + 1);
+
+                queue = queue
+                    .then(() => handleRequest(pool, conn, line))
+                    .then((reply) => {
+                        if (!conn.destroyed) {
+                            reply.forEach((chunk) => conn.write(chunk));
+                        }
+                    });
+            }
+        });
+        conn.on('error', (e) => console.error(e));
+    });
+
+    // Remove a socket left by a crashed server.
+    if (process.platform != 'win32' && fs.existsSync(socket_path)) {
+        fs.unlinkSync(socket_path);
+    }
+
+    server.listen(socket_path, () => console.log('ready'));
+
+    process.stdin.on('end', async () => {
+        server.close();
+        await browser.close();
+        process.exit(0);
+    });
+    process.stdin.resume();
+}
+
+async function runOnce(argv) {
+    const browser = await launchBrowser();
+    const page = await browser.newPage();
+
+    await render(page, path.resolve(argv[0]), argv[1],
+                 argv[2] != undefined ? parseInt(argv[2]) : undefined);
 
     browser.close();
+}
+
+var argv = process.argv.slice(2);
+
+(async() => {
 
+try {
+    if (argv[0] == '--server') {
+        await runServer(argv[1]);
+    } else {
+        await runOnce(argv);
+    }
 } catch (e) {
     console.log(e)
     process.exit(1)
@@ -5,12 +5,183 @@
 
 #include <cmath>
 
+#ifdef Q_OS_WIN
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Output path that indicates that the image should be sent back in the server mode.
+static const QString InMemory = "-";
+
+class Renderer
+{
+public:
+    // Returns an error message or an empty string on success.
+    QString render(const QByteArray &svgData, const QString &outPath, const int width);
+
+    // Handles a `in.svg\tout.png\twidth` request.
+    QString render(const QStringList &request);
+
+    const QImage& image() const { return m_img; }
+
+private:
+    // Reused between renders to avoid an allocation per file.
+    QImage m_img;
+};
+
+QString Renderer::render(const QByteArray &svgData, const QString &outPath, const int width)
+{
+    QSvgRenderer render(svgData);
+
+    if (!render.isValid()) {
+        return "Invalid SVG data.";
+    }
+
+    QSize imgSize = render.viewBox().size();
+
+    // Scale to width.
+    if (width != 0) {
+        imgSize.setHeight(std::ceil(double(width) * imgSize.height() / imgSize.width()));
+        imgSize.setWidth(width);
+    }
+
+    // Premultiplied pixels are sent back as is, while files must not lose
+    // the precision of semi-transparent pixels.
+    const auto format = outPath == InMemory ? QImage::Format_ARGB32_Premultiplied
+                                            : QImage::Format_ARGB32;
+    if (m_img.size() != imgSize || m_img.format() != format) {
+        m_img = QImage(imgSize, format);
+    }
+    m_img.fill(Qt::transparent);
+
+    QPainter p(&m_img);
+    render.render(&p);
+    p.end();
+
+    if (outPath != InMemory && !m_img.save(outPath)) {
+        return "Failed to save an output file.";
+    }
+
+    return QString();
+}
+
+QString Renderer::render(const QStringList &request)
+{
+    // Paths cannot contain tabs and line breaks, so a request with them is split incorrectly.
+    bool ok = request.size() == 3;
+    const uint width = ok ? request.at(2).toUInt(&ok) : 0;
+    if (!ok) {
+        return "Invalid request.";
+    }
+
+    QFile file(request.at(0));
+    if (!file.open(QFile::ReadOnly)) {
+        return "Failed to open an input file.";
+    }
+
+    return render(file.readAll(), request.at(1), width);
+}
+
+static QStringList parseRequest(const QString &line)
+{
+    return line.trimmed().split('\t');
+}
+
+// Reads requests from stdin and replies with `ok` or `error: msg`.
+//
+// When the output path is `-`, replies with `raw <width> <height>` followed by
+// ARGB32_Premultiplied pixels instead.
+static int runServer()
+{
+#ifdef Q_OS_WIN
+    // Raw pixels must not be altered by the newlines conversion.
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    QFile input;
+    QFile output;
+    if (!input.open(stdin, QFile::ReadOnly) || !output.open(stdout, QFile::WriteOnly)) {
+        return 1;
+    }
+
+    Renderer renderer;
+    while (true) {
+        const auto line = QString::fromUtf8(input.readLine());
+        if (line.isEmpty()) {
+            // EOF.
+            break;
+        }
+
+        const auto request = parseRequest(line);
+        const auto error = renderer.render(request);
+        if (!error.isEmpty()) {
+            output.write(("error: " + error + "\n").toUtf8());
+        } else if (request.at(1) == InMemory) {
+            const auto &img = renderer.image();
+            output.write(QString("raw %1 %2\n").arg(img.width()).arg(img.height()).toUtf8());
+            output.write((const char*)img.constBits(), img.bytesPerLine() * img.height());
+        } else {
+            output.write("ok\n");
+        }
+        output.flush();
+    }
+
+    return 0;
+}
+
+// Renders all requests from a file. One request per line.
+static int runList(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        printf("Error: Failed to open a list file.\n");
+        return 1;
+    }
+
+    int failed = 0;
+    Renderer renderer;
+    while (!file.atEnd()) {
+        const auto line = QString::fromUtf8(file.readLine()).trimmed();
+        if (line.isEmpty()) {
+            continue;
+        }
+
+        const auto request = parseRequest(line);
+        const auto error = request.value(1) == InMemory
+                            ? QString("In-memory output is not supported.")
+                            : renderer.render(request);
+        if (!error.isEmpty()) {
+            printf("Error: %s: %s\n", qPrintable(line.section('\t', 0, 0)), qPrintable(error));
+            failed++;
+        }
+    }
+
+    return failed == 0 ? 0 : 1;
+}
+
 int main(int argc, char *argv[])
 {
+    const bool isServer = argc == 2 && qstrcmp(argv[1], "--server") == 0;
+    const bool isList = argc == 3 && qstrcmp(argv[1], "--list") == 0;
+    if (isServer || isList) {
+        // Text rendering requires QGuiApplication and we don't know
+        // what files will be rendered, so we have to initialize it anyway.
+        // It will be shared by all files.
+        QGuiApplication app(argc, argv);
+        return isServer ? runServer() : runList(argv[2]);
+    }
+
     if (!(argc == 3 || argc == 4)) {
         printf("Usage:\n"
                "  qtsvgrender in.svg out.png\n"
-               "  qtsvgrender in.svg out.png 500\n");
+               "  qtsvgrender in.svg out.png 500\n"
+               "  qtsvgrender --list list.txt\n"
+               "  qtsvgrender --server\n"
+               "\n"
+               "Each line in a list file and in the server mode input\n"
+               "has the 'in.svg<TAB>out.png<TAB>width' format.\n"
+               "Paths cannot contain tabs and line breaks.\n"
+               "Width can be set to 0 to keep the original size.\n");
         return 1;
     }
 
@@ -29,32 +200,12 @@ int main(int argc, char *argv[])
     QScopedPointer<QCoreApplication> app(isGuiRequired ? new QGuiApplication(argc, argv)
                                                        : new QCoreApplication(argc, argv));
 
-    QSvgRenderer render(svgData);
-
-    if (!render.isValid()) {
-        printf("Error: Invalid SVG data.\n");
+    const int width = argc == 4 ? QString(argv[3]).toUInt() : 0;
+    const QString error = Renderer().render(svgData, argv[2], width);
+    if (!error.isEmpty()) {
+        printf("Error: %s\n", qPrintable(error));
         return 1;
     }
 
-    QSize imgSize = render.viewBox().size();
-
-    // Scale to width.
-    if (argc == 4) {
-        const int w = QString(argv[3]).toUInt();
-        if (w != 0) {
-            imgSize.setHeight(std::ceil(double(w) * imgSize.height() / imgSize.width()));
-            imgSize.setWidth(w);
-        }
-    }
-
-    QImage img(imgSize, QImage::Format_ARGB32);
-    img.fill(Qt::transparent);
-
-    QPainter p(&img);
-    render.render(&p);
-    p.end();
-
-    img.save(argv[2]);
-
     return 0;
 }
@@ -0,0 +1,234 @@
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QQueue>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrentRun>
+#include <QDebug>
+
+#include "imagecache.h"
+#include "processscheduler.h"
+#include "render.h"
+#include "settings.h"
+
+#include "batch.h"
+
+struct PendingTest
+{
+    int idx;
+    QHash<Backend, QImage> cached;
+    QVector<QFuture<RenderResult>> renders;
+};
+
+struct BackendSummary
+{
+    int matched = 0;
+    int mismatched = 0;
+    int errors = 0;
+    int regressions = 0;
+    // Renders waiting for a ProcessScheduler slot, sampled after each test.
+    int maxQueueDepth = 0;
+};
+
+static QString stateToString(const TestState state)
+{
+    switch (state) {
+        case TestState::Unknown : return "unknown";
+        case TestState::Passed  : return "passed";
+        case TestState::Failed  : return "failed";
+        case TestState::Crashed : return "crashed";
+    }
+
+    Q_UNREACHABLE();
+}
+
+int Batch::run(const Settings &settings, const BatchOptions &opt)
+{
+    Tests tests;
+    try {
+        if (settings.testSuite == TestSuite::Custom) {
+            tests = Tests::loadCustom(settings.customTestsPath);
+        } else {
+            tests = Tests::load(settings.testSuite, settings.resultsPath(), settings.testsPath());
+        }
+    } catch (const QString &msg) {
+        qCritical().noquote() << msg;
+        return 2;
+    }
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(opt.jobs);
+    ProcessScheduler::instance().setThreadPool(RenderPriority::Batch, &pool);
+
+    ImageCache cache;
+    cache.setPackEnabled(settings.usePackCache);
+
+    BackendSummary summary[BackendsCount];
+    QJsonArray testsJson;
+    bool hasRegressions = false;
+
+    const auto submit = [&](const int idx) -> PendingTest {
+        PendingTest pending;
+        pending.idx = idx;
+
+        const auto list = Render::prepareRenderData(settings, tests.at(idx).path,
+                                                    settings.viewSize, CancelToken(),
+                                                    RenderPriority::Batch);
+        for (const RenderData &data : list) {
+            if (opt.useCache) {
+                const auto key = Render::cacheKey(settings, data.type, data.imgPath,
+                                                  data.viewSize);
+                const auto img = key.svgHash.isEmpty() ? QImage() : cache.getImage(key);
+                if (!img.isNull()) {
+                    pending.cached.insert(data.type, img);
+                    continue;
+                }
+            }
+
+            pending.renders << QtConcurrent::run(&pool, &Render::renderImage, data);
+        }
+
+        return pending;
+    };
+
+    const auto finish = [&](PendingTest &pending) {
+        const TestItem &item = tests.at(pending.idx);
+
+        for (int i = 0; i < BackendsCount; ++i) {
+            auto &stats = summary[i];
+            stats.maxQueueDepth = qMax(stats.maxQueueDepth,
+                                       ProcessScheduler::instance().queueDepth((Backend)i));
+        }
+
+        QHash<Backend, QImage> imgs = pending.cached;
+        QHash<Backend, QString> errors;
+        for (auto &future : pending.renders) {
+            const auto res = future.result();
+            imgs.insert(res.type, res.img);
+
+            if (!res.error.isEmpty()) {
+                errors.insert(res.type, res.error);
+            } else if (opt.useCache) {
+                const auto key = Render::cacheKey(settings, res.type, item.path,
+                                                  settings.viewSize);
+                if (!key.svgHash.isEmpty()) {
+                    cache.setImage(key, res.img);
+                }
+            }
+        }
+
+        QJsonObject testJson;
+        testJson["path"] = item.baseName;
+
+        const auto refType = settings.testSuite == TestSuite::Custom ? Backend::Chrome
+                                                                     : Backend::Reference;
+        if (errors.contains(refType)) {
+            testJson["error"] = errors.value(refType);
+            testsJson.append(testJson);
+            return;
+        }
+
+        QJsonObject resultsJson;
+        for (const DiffData &data : Render::prepareDiffData(settings.testSuite, imgs)) {
+            auto &stats = summary[(int)data.type];
+            const auto recorded = item.state.value(data.type);
+
+            QJsonObject resultJson;
+            bool isMatched = false;
+            if (errors.contains(data.type)) {
+                resultJson["error"] = errors.value(data.type);
+                stats.errors++;
+            } else {
+                const auto diff = Render::diffImage(data);
+                resultJson["diffPixels"] = diff.diffPixels;
+
+                isMatched = diff.diffPixels <= opt.maxDiffPixels;
+                if (isMatched) {
+                    stats.matched++;
+                } else {
+                    stats.mismatched++;
+                }
+            }
+
+            if (settings.testSuite == TestSuite::Own) {
+                const bool isRegression = recorded == TestState::Passed && !isMatched;
+                resultJson["recorded"] = stateToString(recorded);
+                resultJson["regression"] = isRegression;
+
+                if (isRegression) {
+                    stats.regressions++;
+                    hasRegressions = true;
+                    qWarning().noquote() << QString("%1: %2 no longer matches the reference.")
+                                            .arg(item.baseName, backendToString(data.type));
+                }
+            }
+
+            resultsJson[backendToString(data.type)] = resultJson;
+        }
+
+        testJson["results"] = resultsJson;
+        testsJson.append(testJson);
+    };
+
+    // Limit the amount of tests in flight, so we will not keep all the images in memory.
+    const int window = qMax(opt.jobs, BackendsCount) * 2;
+
+    QQueue<PendingTest> queue;
+    for (int idx = 0; idx < tests.size(); ++idx) {
+        queue.enqueue(submit(idx));
+
+        while (queue.size() >= window) {
+            finish(queue.head());
+            queue.dequeue();
+        }
+    }
+
+    while (!queue.isEmpty()) {
+        finish(queue.head());
+        queue.dequeue();
+    }
+
+    ProcessScheduler::instance().setThreadPool(RenderPriority::Batch, nullptr);
+
+    QJsonObject summaryJson;
+    for (int i = 0; i < BackendsCount; ++i) {
+        const auto backend = (Backend)i;
+        const auto &stats = summary[i];
+        if (stats.matched + stats.mismatched + stats.errors == 0) {
+            continue;
+        }
+
+        QJsonObject json;
+        json["matched"] = stats.matched;
+        json["mismatched"] = stats.mismatched;
+        json["errors"] = stats.errors;
+        json["regressions"] = stats.regressions;
+        json["maxQueueDepth"] = stats.maxQueueDepth;
+        summaryJson[backendToString(backend)] = json;
+
+        const int limit = ProcessScheduler::instance().limit(backend);
+        qInfo().noquote() << QString("%1: %2 matched, %3 mismatched, %4 errors, %5 regressions, "
+                                     "up to %6 queued renders (%7)")
+                             .arg(backendToString(backend))
+                             .arg(stats.matched).arg(stats.mismatched)
+                             .arg(stats.errors).arg(stats.regressions)
+                             .arg(stats.maxQueueDepth)
+                             .arg(limit != 0 ? QString("limit: %1").arg(limit) : QString("no limit"));
+    }
+
+    QJsonObject reportJson;
+    reportJson["viewSize"] = settings.viewSize;
+    reportJson["tests"] = testsJson;
+    reportJson["summary"] = summaryJson;
+
+    QFile file(opt.outputPath);
+    if (!file.open(QFile::WriteOnly)) {
+        qCritical().noquote() << QString("Failed to open %1.").arg(opt.outputPath);
+        return 2;
+    }
+
+    file.write(QJsonDocument(reportJson).toJson());
+
+    return hasRegressions ? 1 : 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <QString>
+
+class Settings;
+
+struct BatchOptions
+{
+    QString outputPath;
+    int jobs;
+    int maxDiffPixels;
+    bool useCache;
+};
+
+class Batch
+{
+public:
+    // Renders all tests using the enabled backends, compares them with the reference
+    // and writes a JSON report.
+    //
+    // Returns 0 on success, 1 when some of the tests that were marked as passed
+    // do not match the reference anymore and 2 on a fatal error.
+    static int run(const Settings &settings, const BatchOptions &opt);
+};
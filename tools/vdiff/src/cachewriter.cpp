@@ -0,0 +1,207 @@
+#include <QDateTime>
+#include <QDeadlineTimer>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QVariant>
+
+#include "cachewriter.h"
+
+static const QString DbName = "cache_db_writer";
+// Gives time to accumulate a batch.
+static const int BatchDelay = 250; // ms
+static const int MaxBatchSize = 256;
+
+// Prepared once per connection.
+struct CacheWriter::Statements
+{
+    explicit Statements(const QSqlDatabase &db)
+        : insert(db)
+        , remove(db)
+        , touch(db)
+    {
+        insert.prepare("INSERT OR REPLACE INTO Images "
+                       "       ( Key,  Backend,  Version,  ViewSize,  PackOffset,  Size, "
+                       "         LastAccess) "
+                       "VALUES (:Key, :Backend, :Version, :ViewSize, :PackOffset, :Size, "
+                       "        :LastAccess);");
+        remove.prepare("DELETE FROM Images WHERE Key = :Key;");
+        touch.prepare("UPDATE Images SET LastAccess = :LastAccess WHERE Key = :Key;");
+    }
+
+    QSqlQuery insert;
+    QSqlQuery remove;
+    QSqlQuery touch;
+};
+
+CacheWriter::CacheWriter(const QString &dbPath)
+    : m_dbPath(dbPath)
+{
+    start(QThread::LowPriority);
+}
+
+CacheWriter::~CacheWriter()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_isStopped = true;
+        m_cond.wakeAll();
+    }
+
+    wait();
+}
+
+void CacheWriter::insert(const CacheKey &key, const QByteArray &id, const QImage &img,
+                         const QString &pngPath, const qint64 packOffset)
+{
+    enqueue({ Operation::Insert, id, key, img, pngPath, packOffset });
+}
+
+void CacheWriter::remove(const QByteArray &id)
+{
+    enqueue({ Operation::Remove, id, CacheKey(), QImage(), QString(), 0 });
+}
+
+void CacheWriter::touch(const QByteArray &id)
+{
+    enqueue({ Operation::Touch, id, CacheKey(), QImage(), QString(), 0 });
+}
+
+void CacheWriter::enqueue(const Entry &entry)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queue << entry;
+
+    if (entry.operation == Operation::Insert && !entry.pngPath.isEmpty()) {
+        m_pendingImages.insert(entry.id, entry.img);
+    }
+
+    m_cond.wakeAll();
+}
+
+QImage CacheWriter::pendingImage(const QByteArray &id) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_pendingImages.value(id);
+}
+
+void CacheWriter::run()
+{
+    {
+        auto db = QSqlDatabase::addDatabase("QSQLITE", DbName);
+        db.setDatabaseName(m_dbPath);
+        db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
+        if (!db.open()) {
+            qWarning().noquote() << "cache:" << db.lastError().text();
+        }
+
+        // Transactions are durable enough for a cache without an fsync per commit.
+        QSqlQuery(db).exec("PRAGMA synchronous = NORMAL;");
+
+        Statements statements(db);
+
+        while (true) {
+            QVector<Entry> batch;
+            {
+                QMutexLocker locker(&m_mutex);
+                while (m_queue.isEmpty() && !m_isStopped) {
+                    m_cond.wait(&m_mutex);
+                }
+
+                if (m_queue.isEmpty()) {
+                    break;
+                }
+
+                const QDeadlineTimer deadline(BatchDelay);
+                while (!m_isStopped && m_queue.size() < MaxBatchSize) {
+                    if (!m_cond.wait(&m_mutex, deadline)) {
+                        break;
+                    }
+                }
+
+                batch.swap(m_queue);
+            }
+
+            write(db, statements, batch);
+
+            QMutexLocker locker(&m_mutex);
+            for (const Entry &entry : batch) {
+                m_pendingImages.remove(entry.id);
+            }
+        }
+    }
+
+    QSqlDatabase::removeDatabase(DbName);
+}
+
+void CacheWriter::write(QSqlDatabase &db, Statements &statements,
+                        const QVector<Entry> &batch)
+{
+    const auto now = QDateTime::currentSecsSinceEpoch();
+
+    // PNG encoding is the slowest part, so it's done outside of the transaction.
+    QVector<qint64> sizes(batch.size(), 0);
+    for (int i = 0; i < batch.size(); ++i) {
+        const Entry &entry = batch.at(i);
+        if (entry.operation != Operation::Insert) {
+            continue;
+        }
+
+        if (entry.pngPath.isEmpty()) {
+            sizes[i] = entry.img.sizeInBytes();
+            continue;
+        }
+
+        QDir().mkpath(QFileInfo(entry.pngPath).absolutePath());
+        if (entry.img.save(entry.pngPath)) {
+            sizes[i] = QFileInfo(entry.pngPath).size();
+        } else {
+            qWarning().noquote() << "cache: failed to save" << entry.pngPath;
+            sizes[i] = -1;
+        }
+    }
+
+    db.transaction();
+
+    for (int i = 0; i < batch.size(); ++i) {
+        const Entry &entry = batch.at(i);
+        if (sizes.at(i) == -1) {
+            continue;
+        }
+
+        QSqlQuery *query = nullptr;
+        switch (entry.operation) {
+            case Operation::Insert : query = &statements.insert; break;
+            case Operation::Remove : query = &statements.remove; break;
+            case Operation::Touch  : query = &statements.touch; break;
+        }
+
+        query->bindValue(":Key", entry.id);
+
+        if (entry.operation != Operation::Remove) {
+            query->bindValue(":LastAccess", now);
+        }
+
+        if (entry.operation == Operation::Insert) {
+            const bool isPacked = entry.pngPath.isEmpty();
+            query->bindValue(":Backend", backendToString(entry.key.backend));
+            query->bindValue(":Version", entry.key.version);
+            query->bindValue(":ViewSize", entry.key.viewSize);
+            query->bindValue(":PackOffset", isPacked ? QVariant(entry.packOffset) : QVariant());
+            query->bindValue(":Size", sizes.at(i));
+        }
+
+        if (!query->exec()) {
+            qWarning().noquote() << "cache:" << query->lastError().text();
+        }
+    }
+
+    if (!db.commit()) {
+        qWarning().noquote() << "cache:" << db.lastError().text();
+        db.rollback();
+    }
+}
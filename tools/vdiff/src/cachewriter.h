@@ -0,0 +1,68 @@
+#pragma once
+
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "imagecache.h"
+
+class QSqlDatabase;
+
+// Writes cache entries in background.
+//
+// Entries are grouped into transactions, so populating the cache doesn't cost
+// an fsync per entry. Remaining entries are written on destruction.
+class CacheWriter : public QThread
+{
+public:
+    enum class Operation
+    {
+        Insert,
+        Remove,
+        // Updates the last access time.
+        Touch,
+    };
+
+    struct Entry
+    {
+        Operation operation;
+        QByteArray id;
+        CacheKey key;
+        QImage img;
+        // Empty for packed images.
+        QString pngPath;
+        qint64 packOffset;
+    };
+
+    explicit CacheWriter(const QString &dbPath);
+    ~CacheWriter();
+
+    void insert(const CacheKey &key, const QByteArray &id, const QImage &img,
+                const QString &pngPath, const qint64 packOffset);
+    void remove(const QByteArray &id);
+    void touch(const QByteArray &id);
+
+    // Returns an image that is not saved yet.
+    QImage pendingImage(const QByteArray &id) const;
+
+protected:
+    void run() override;
+
+private:
+    struct Statements;
+
+    void enqueue(const Entry &entry);
+    void write(QSqlDatabase &db, Statements &statements, const QVector<Entry> &batch);
+
+private:
+    const QString m_dbPath;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_cond;
+    QVector<Entry> m_queue;
+    QHash<QByteArray, QImage> m_pendingImages;
+    bool m_isStopped = false;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <QAtomicInt>
+#include <QMetaType>
+#include <QSharedPointer>
+
+// A flag that is used to stop an abandoned work.
+//
+// Copies share the same state, so a token can be passed to worker threads by value.
+class CancelToken
+{
+public:
+    CancelToken() : m_flag(QSharedPointer<QAtomicInt>::create(0)) {}
+
+    void cancel() const noexcept { m_flag->storeRelease(1); }
+    bool isCancelled() const noexcept { return m_flag->loadAcquire() != 0; }
+
+private:
+    QSharedPointer<QAtomicInt> m_flag;
+};
+
+Q_DECLARE_METATYPE(CancelToken)
@@ -0,0 +1,253 @@
+#include "diffkernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIFF_USE_X86
+#define DIFF_USE_AVX2
+#define DIFF_TARGET(t) __attribute__((target(t)))
+#include <immintrin.h>
+#elif defined(_M_X64)
+#define DIFF_USE_X86
+#define DIFF_TARGET(t)
+#include <intrin.h>
+#endif
+
+// A distance that is bigger than 5 means that the colors are different.
+// `int(sqrt(d)) > 5` is the same as `d > 35`, so we can avoid `sqrt`.
+static const int MaxDistanceSquared = 35;
+
+static const QRgb DiffColor = 0xFFFF0000;
+static const QRgb SameColor = 0xFFFFFFFF;
+
+// Rounded `x / 255` for `x` in 0..65025.
+static inline int div255(int x) noexcept
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// Source-over composition on white: `c * a + 255 * (1 - a)`.
+template<bool Premultiplied>
+static inline int flatten(int c, int a) noexcept
+{
+    if (!Premultiplied) {
+        c = div255(c * a);
+    }
+
+    return c + 255 - a;
+}
+
+template<bool Premultiplied1, bool Premultiplied2>
+static int diffScalar(const QRgb *s1, const QRgb *s2, QRgb *out, int width) noexcept
+{
+    int count = 0;
+    for (int x = 0; x < width; ++x) {
+        const int a1 = qAlpha(s1[x]);
+        const int a2 = qAlpha(s2[x]);
+        const int rd = flatten<Premultiplied1>(qRed(s1[x]), a1)
+                     - flatten<Premultiplied2>(qRed(s2[x]), a2);
+        const int gd = flatten<Premultiplied1>(qGreen(s1[x]), a1)
+                     - flatten<Premultiplied2>(qGreen(s2[x]), a2);
+        const int bd = flatten<Premultiplied1>(qBlue(s1[x]), a1)
+                     - flatten<Premultiplied2>(qBlue(s2[x]), a2);
+
+        if (rd * rd + gd * gd + bd * bd > MaxDistanceSquared) {
+            out[x] = DiffColor;
+            count++;
+        } else {
+            out[x] = SameColor;
+        }
+    }
+
+    return count;
+}
+
+#ifdef DIFF_USE_X86
+static inline int popCount4(int mask) noexcept
+{
+    return (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+}
+
+// The same as `flatten`, but for two pixels stored as 16-bit BGRA channels.
+template<bool Premultiplied>
+DIFF_TARGET("sse2")
+static inline __m128i flattenSse2(__m128i c) noexcept
+{
+    const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)),
+                                              _MM_SHUFFLE(3, 3, 3, 3));
+
+    if (!Premultiplied) {
+        c = _mm_add_epi16(_mm_mullo_epi16(c, alpha), _mm_set1_epi16(128));
+        c = _mm_srli_epi16(_mm_add_epi16(c, _mm_srli_epi16(c, 8)), 8);
+    }
+
+    return _mm_add_epi16(c, _mm_sub_epi16(_mm_set1_epi16(255), alpha));
+}
+
+// Processes 4 pixels at a time.
+template<bool Premultiplied1, bool Premultiplied2>
+DIFF_TARGET("sse2")
+static int diffSse2(const QRgb *s1, const QRgb *s2, QRgb *out, int width) noexcept
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgbMask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i greenBlueMask = _mm_set1_epi32(0x0000FFFF);
+    const __m128i sameColor = _mm_set1_epi32((int)SameColor);
+    const __m128i maxDist = _mm_set1_epi32(MaxDistanceSquared);
+
+    int count = 0;
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(s1 + x));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(s2 + x));
+
+        // Pixels 0-1 and 2-3 as 16-bit BGRA channels, without the alpha difference.
+        const __m128i dLo = _mm_and_si128(
+            _mm_sub_epi16(flattenSse2<Premultiplied1>(_mm_unpacklo_epi8(a, zero)),
+                          flattenSse2<Premultiplied2>(_mm_unpacklo_epi8(b, zero))),
+            rgbMask);
+        const __m128i dHi = _mm_and_si128(
+            _mm_sub_epi16(flattenSse2<Premultiplied1>(_mm_unpackhi_epi8(a, zero)),
+                          flattenSse2<Premultiplied2>(_mm_unpackhi_epi8(b, zero))),
+            rgbMask);
+
+        // [B²+G², R²] per pixel.
+        const __m128i sqLo = _mm_madd_epi16(dLo, dLo);
+        const __m128i sqHi = _mm_madd_epi16(dHi, dHi);
+
+        // Sum pairs, keeping the pixels order.
+        const __m128 lo = _mm_castsi128_ps(sqLo);
+        const __m128 hi = _mm_castsi128_ps(sqHi);
+        const __m128i even = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m128i odd = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        const __m128i dist = _mm_add_epi32(even, odd);
+
+        const __m128i diffMask = _mm_cmpgt_epi32(dist, maxDist);
+
+        // White with green and blue channels cleared is red.
+        const __m128i res = _mm_andnot_si128(_mm_and_si128(diffMask, greenBlueMask), sameColor);
+        _mm_storeu_si128((__m128i *)(out + x), res);
+
+        count += popCount4(_mm_movemask_ps(_mm_castsi128_ps(diffMask)));
+    }
+
+    return count + diffScalar<Premultiplied1, Premultiplied2>(s1 + x, s2 + x, out + x, width - x);
+}
+#endif
+
+#ifdef DIFF_USE_AVX2
+template<bool Premultiplied>
+DIFF_TARGET("avx2")
+static inline __m256i flattenAvx2(__m256i c) noexcept
+{
+    const __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)),
+                                                 _MM_SHUFFLE(3, 3, 3, 3));
+
+    if (!Premultiplied) {
+        c = _mm256_add_epi16(_mm256_mullo_epi16(c, alpha), _mm256_set1_epi16(128));
+        c = _mm256_srli_epi16(_mm256_add_epi16(c, _mm256_srli_epi16(c, 8)), 8);
+    }
+
+    return _mm256_add_epi16(c, _mm256_sub_epi16(_mm256_set1_epi16(255), alpha));
+}
+
+// The same as diffSse2, but processes 8 pixels at a time.
+// Unpack and shuffle instructions are working per 128-bit lane,
+// so the pixels order is preserved.
+template<bool Premultiplied1, bool Premultiplied2>
+DIFF_TARGET("avx2")
+static int diffAvx2(const QRgb *s1, const QRgb *s2, QRgb *out, int width) noexcept
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i rgbMask = _mm256_set1_epi64x(0x0000FFFFFFFFFFFF);
+    const __m256i greenBlueMask = _mm256_set1_epi32(0x0000FFFF);
+    const __m256i sameColor = _mm256_set1_epi32((int)SameColor);
+    const __m256i maxDist = _mm256_set1_epi32(MaxDistanceSquared);
+
+    int count = 0;
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(s1 + x));
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(s2 + x));
+
+        const __m256i dLo = _mm256_and_si256(
+            _mm256_sub_epi16(flattenAvx2<Premultiplied1>(_mm256_unpacklo_epi8(a, zero)),
+                             flattenAvx2<Premultiplied2>(_mm256_unpacklo_epi8(b, zero))),
+            rgbMask);
+        const __m256i dHi = _mm256_and_si256(
+            _mm256_sub_epi16(flattenAvx2<Premultiplied1>(_mm256_unpackhi_epi8(a, zero)),
+                             flattenAvx2<Premultiplied2>(_mm256_unpackhi_epi8(b, zero))),
+            rgbMask);
+
+        const __m256 lo = _mm256_castsi256_ps(_mm256_madd_epi16(dLo, dLo));
+        const __m256 hi = _mm256_castsi256_ps(_mm256_madd_epi16(dHi, dHi));
+        const __m256i even = _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m256i odd = _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        const __m256i dist = _mm256_add_epi32(even, odd);
+
+        const __m256i diffMask = _mm256_cmpgt_epi32(dist, maxDist);
+
+        const __m256i res = _mm256_andnot_si256(_mm256_and_si256(diffMask, greenBlueMask),
+                                                sameColor);
+        _mm256_storeu_si256((__m256i *)(out + x), res);
+
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(diffMask)));
+    }
+
+    return count + diffSse2<Premultiplied1, Premultiplied2>(s1 + x, s2 + x, out + x, width - x);
+}
+#endif
+
+enum class Isa
+{
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+static Isa detectIsa() noexcept
+{
+#ifdef DIFF_USE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return Isa::Avx2;
+    }
+
+    if (__builtin_cpu_supports("sse2")) {
+        return Isa::Sse2;
+    }
+#elif defined(DIFF_USE_X86)
+    // SSE2 is always available on x86_64.
+    return Isa::Sse2;
+#endif
+
+    return Isa::Scalar;
+}
+
+template<bool Premultiplied1, bool Premultiplied2>
+static int diffScanlineImpl(const QRgb *s1, const QRgb *s2, QRgb *out, int width) noexcept
+{
+    static const Isa isa = detectIsa();
+
+    switch (isa) {
+#ifdef DIFF_USE_AVX2
+        case Isa::Avx2 : return diffAvx2<Premultiplied1, Premultiplied2>(s1, s2, out, width);
+#endif
+#ifdef DIFF_USE_X86
+        case Isa::Sse2 : return diffSse2<Premultiplied1, Premultiplied2>(s1, s2, out, width);
+#endif
+        default : return diffScalar<Premultiplied1, Premultiplied2>(s1, s2, out, width);
+    }
+}
+
+int DiffKernel::diffScanline(const QRgb *s1, bool premultiplied1,
+                             const QRgb *s2, bool premultiplied2,
+                             QRgb *out, int width) noexcept
+{
+    if (premultiplied1) {
+        return premultiplied2 ? diffScanlineImpl<true, true>(s1, s2, out, width)
+                              : diffScanlineImpl<true, false>(s1, s2, out, width);
+    } else {
+        return premultiplied2 ? diffScanlineImpl<false, true>(s1, s2, out, width)
+                              : diffScanlineImpl<false, false>(s1, s2, out, width);
+    }
+}
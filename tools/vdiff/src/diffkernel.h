@@ -0,0 +1,21 @@
+#pragma once
+
+#include <QRgb>
+
+namespace DiffKernel {
+    // Compares two scanlines of ARGB32 pixels.
+    //
+    // Pixels are composited on a white background before comparison.
+    // `premultiplied1` and `premultiplied2` indicate whether the corresponding scanline
+    // is in the ARGB32_Premultiplied format. RGB32 scanlines can be passed as either one.
+    //
+    // Pixels are treated as different when the distance between colors is bigger than 5.
+    // Different pixels are written into `out` as red and equal ones as white.
+    //
+    // Returns the amount of different pixels.
+    //
+    // Uses AVX2 or SSE2 when available.
+    int diffScanline(const QRgb *s1, bool premultiplied1,
+                     const QRgb *s2, bool premultiplied2,
+                     QRgb *out, int width) noexcept;
+};
@@ -1,126 +1,598 @@
 #include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QSaveFile>
+#include <QSet>
 #include <QSqlDatabase>
+#include <QSqlError>
 #include <QSqlQuery>
-#include <QUuid>
 #include <QVariant>
 
 #include "paths.h"
+#include "cachewriter.h"
+#include "imagepack.h"
 #include "imagecache.h"
 
+#include <algorithm>
+
 static const QString DbName = "cache_db";
 static const QString DbFileName = "cache.sqlite";
+static const QString PackFileName = "cache.pack";
+static const int DbVersion = 3;
+
+static const quint32 ArchiveMagic = 0x56444341; // VDCA
+static const quint32 ArchiveVersion = 1;
+
+// An index value of images stored as PNG files.
+static const qint64 NotPacked = -1;
 
-enum class Column
+static QString dbPath()
 {
-    ID,
-    SvgPath,
-    PngPath,
-    Backend,
-    Hash,
-};
+    return Paths::workDir() + '/' + DbFileName;
+}
 
-static void initCacheDb()
+static QString packPath()
 {
-    auto db = QSqlDatabase::addDatabase("QSQLITE", DbName);
-    db.setDatabaseName(Paths::workDir() + '/' + DbFileName);
-    db.open();
+    return Paths::workDir() + '/' + PackFileName;
+}
 
-    QSqlQuery query(db);
-    query.exec("CREATE TABLE Cache ("
-        "ID INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "SvgPath TEXT,"
-        "PngPath TEXT,"
-        "Backend TEXT,"
-        "Hash TEXT"
-    ");");
+static QString imagesDir()
+{
+    return Paths::workDir() + "/images";
+}
+
+static QString imagePath(const QByteArray &id)
+{
+    return imagesDir() + '/' + QString::fromLatin1(id) + ".png";
 }
 
-static void openCacheDb()
+static void execQuery(QSqlQuery &query, const QString &sql)
 {
-    if (!QFile::exists(DbFileName)) {
-        initCacheDb();
-    } else {
-        auto db = QSqlDatabase::addDatabase("QSQLITE", DbName);
-        db.setDatabaseName(DbFileName);
-        db.open();
+    if (!query.exec(sql)) {
+        qWarning().noquote() << "cache:" << query.lastError().text();
     }
 }
 
-static QString fileMd5Sum(const QString &path)
+static void initCacheDb(QSqlDatabase &db)
 {
-    QFile file(path);
-    if (!file.open(QFile::ReadOnly)) {
-        throw QString("failed to open %1").arg(path);
+    QSqlQuery query(db);
+    execQuery(query, "PRAGMA user_version;");
+    const int version = query.next() ? query.value(0).toInt() : 0;
+    if (version == DbVersion) {
+        return;
+    }
+
+    if (version < 1) {
+        // Entries of the first version are keyed by an SVG path and cannot be reused.
+        execQuery(query, "DROP TABLE IF EXISTS Cache;");
+        QDir(imagesDir()).removeRecursively();
+
+        execQuery(query, "CREATE TABLE Images ("
+            "Key TEXT PRIMARY KEY,"
+            "Backend TEXT,"
+            "Version TEXT,"
+            "ViewSize INTEGER"
+        ");");
     }
 
-    return QCryptographicHash::hash(file.readAll(), QCryptographicHash::Md5).toHex();
+    if (version < 2) {
+        // NULL for PNG files.
+        execQuery(query, "ALTER TABLE Images ADD COLUMN PackOffset INTEGER;");
+    }
+
+    if (version < 3) {
+        // Used by the garbage collector. NULL for older entries.
+        execQuery(query, "ALTER TABLE Images ADD COLUMN Size INTEGER;");
+        execQuery(query, "ALTER TABLE Images ADD COLUMN LastAccess INTEGER;");
+
+        execQuery(query, "CREATE TABLE Stats (Name TEXT PRIMARY KEY, Value INTEGER);");
+        execQuery(query, "INSERT INTO Stats VALUES ('Hits', 0), ('Misses', 0);");
+    }
+
+    execQuery(query, QString("PRAGMA user_version = %1;").arg(DbVersion));
+}
+
+QByteArray CacheKey::id() const
+{
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(svgHash);
+    hash.addData(backendToString(backend).toUtf8());
+    hash.addData(version.toUtf8());
+    hash.addData(QByteArray::number(viewSize));
+    hash.addData(fontConfig.toUtf8());
+    return hash.result().toHex();
 }
 
 ImageCache::ImageCache()
 {
-    openCacheDb();
+    auto db = QSqlDatabase::addDatabase("QSQLITE", DbName);
+    db.setDatabaseName(dbPath());
+    db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
+    if (!db.open()) {
+        qWarning().noquote() << "cache:" << db.lastError().text();
+        return;
+    }
+
+    initCacheDb(db);
+
+    QSqlQuery query(db);
+    // Allows the writer to commit while the database is read.
+    execQuery(query, "PRAGMA journal_mode = WAL;");
+
+    execQuery(query, "SELECT Key, PackOffset FROM Images;");
+    while (query.next()) {
+        const auto offset = query.value(1);
+        m_index.insert(query.value(0).toByteArray(),
+                       offset.isNull() ? NotPacked : offset.toLongLong());
+    }
+
+    // Must be started after the database is initialized.
+    m_writer.reset(new CacheWriter(dbPath()));
 }
 
 ImageCache::~ImageCache()
 {
+    // Writes remaining entries.
+    m_writer.reset();
+
     auto db = QSqlDatabase::database(DbName);
+
+    QSqlQuery query(db);
+    query.prepare("UPDATE Stats SET Value = Value + :Value WHERE Name = :Name;");
+    for (const auto &stat : { qMakePair(QString("Hits"), m_hits),
+                              qMakePair(QString("Misses"), m_misses) }) {
+        query.bindValue(":Value", stat.second);
+        query.bindValue(":Name", stat.first);
+        query.exec();
+    }
+    query = QSqlQuery();
+
     db.close();
     db = QSqlDatabase();
     db.removeDatabase(DbName);
 }
 
-QImage ImageCache::getImage(const Backend backend, const QString &svgPath)
+QImage ImageCache::getImage(const CacheKey &key)
+{
+    QMutexLocker locker(&m_mutex);
+
+    const auto id = key.id();
+    const auto it = m_index.constFind(id);
+    if (it == m_index.constEnd()) {
+        m_misses++;
+        return QImage();
+    }
+
+    const QImage img = loadImage(id, it.value());
+    if (img.isNull()) {
+        // The file was removed or damaged.
+        removeEntry(id);
+        m_misses++;
+        return QImage();
+    }
+
+    // Images are scaled to fit the view, so one of the sides must match it.
+    // Some renderers may be off by a pixel because of rounding.
+    if (qAbs(img.width() - key.viewSize) > 1 && qAbs(img.height() - key.viewSize) > 1) {
+        qWarning().noquote() << QString("cache: %1 image has an invalid size: %2x%3")
+                                .arg(backendToString(key.backend))
+                                .arg(img.width()).arg(img.height());
+        removeEntry(id);
+        m_misses++;
+        return QImage();
+    }
+
+    m_hits++;
+    m_writer->touch(id);
+    return img;
+}
+
+void ImageCache::setImage(const CacheKey &key, const QImage &img)
+{
+    QMutexLocker locker(&m_mutex);
+    insertImage(key.id(), key, img);
+}
+
+void ImageCache::setPackEnabled(const bool flag)
+{
+    QMutexLocker locker(&m_mutex);
+    m_isPackEnabled = flag;
+}
+
+bool ImageCache::insertImage(const QByteArray &id, const CacheKey &key, const QImage &img)
+{
+    if (!m_writer || m_index.contains(id)) {
+        return false;
+    }
+
+    // Appending a raw frame is cheap, unlike PNG encoding, which is done by the writer.
+    qint64 offset = NotPacked;
+    if (m_isPackEnabled) {
+        offset = pack()->append(id, img);
+        if (offset == NotPacked) {
+            qWarning().noquote() << "cache: failed to append to" << PackFileName;
+            return false;
+        }
+    }
+
+    const QString pngPath = offset == NotPacked ? imagePath(id) : QString();
+    m_writer->insert(key, id, img, pngPath, offset);
+    m_index.insert(id, offset);
+    return true;
+}
+
+ImagePack* ImageCache::pack()
+{
+    if (!m_pack) {
+        m_pack.reset(new ImagePack(packPath()));
+    }
+
+    return m_pack.data();
+}
+
+QImage ImageCache::loadImage(const QByteArray &id, const qint64 offset)
+{
+    if (offset == NotPacked) {
+        if (m_writer) {
+            const auto img = m_writer->pendingImage(id);
+            if (!img.isNull()) {
+                return img;
+            }
+        }
+
+        return QImage(imagePath(id));
+    }
+
+    return pack()->frame(offset, id);
+}
+
+void ImageCache::removeEntry(const QByteArray &id)
+{
+    // Packed frames are never removed from the file itself.
+    if (m_index.take(id) == NotPacked) {
+        QFile::remove(imagePath(id));
+    }
+
+    if (m_writer) {
+        m_writer->remove(id);
+    }
+}
+
+CacheStats ImageCache::stats()
+{
+    QMutexLocker locker(&m_mutex);
+
+    CacheStats stats = { {}, m_hits, m_misses, QFileInfo(packPath()).size() };
+
+    QSqlQuery query(QSqlDatabase::database(DbName));
+    execQuery(query, "SELECT Backend, COUNT(*), SUM(Size) FROM Images GROUP BY Backend;");
+    while (query.next()) {
+        const CacheStats::Group group = { query.value(1).toInt(), query.value(2).toLongLong() };
+        stats.backends.insert(query.value(0).toString(), group);
+    }
+
+    execQuery(query, "SELECT Name, Value FROM Stats;");
+    while (query.next()) {
+        const auto name = query.value(0).toString();
+        if (name == "Hits") {
+            stats.hits += query.value(1).toLongLong();
+        } else if (name == "Misses") {
+            stats.misses += query.value(1).toLongLong();
+        }
+    }
+
+    return stats;
+}
+
+CacheGcResult ImageCache::collectGarbage(const qint64 budget)
 {
+    QMutexLocker locker(&m_mutex);
+
+    struct Entry
+    {
+        QByteArray id;
+        qint64 offset;
+        qint64 size;
+        qint64 lastAccess;
+    };
+
+    CacheGcResult result = { 0, 0, 0, 0 };
+
     auto db = QSqlDatabase::database(DbName);
+    if (!db.isOpen()) {
+        return result;
+    }
+
+    // Writes pending entries, so the database is up to date.
+    m_writer.reset();
+
+    QVector<Entry> entries;
+    QVector<QByteArray> removed;
+    // Entries created before sizes were recorded.
+    QVector<Entry> unsized;
+
     QSqlQuery query(db);
-    query.exec(QString("SELECT * FROM Cache WHERE SvgPath='%1' AND Backend='%2';")
-                    .arg(svgPath).arg(backendToString(backend)));
+    execQuery(query, "SELECT Key, PackOffset, Size, LastAccess FROM Images;");
+    while (query.next()) {
+        const auto id = query.value(0).toByteArray();
+        const qint64 offset = query.value(1).isNull() ? NotPacked : query.value(1).toLongLong();
+
+        qint64 size = -1;
+        if (offset == NotPacked) {
+            const QFileInfo fi(imagePath(id));
+            if (fi.exists()) {
+                size = fi.size();
+            }
+        } else if (QFile::exists(packPath())) {
+            const QImage img = pack()->frame(offset, id);
+            if (!img.isNull()) {
+                size = img.sizeInBytes();
+            }
+        }
+
+        if (size == -1) {
+            result.missing++;
+            removed << id;
+            continue;
+        }
+
+        // A NULL access time makes an entry the first to be evicted.
+        const Entry entry = { id, offset, size, query.value(3).toLongLong() };
+        entries << entry;
+
+        if (query.value(2).isNull()) {
+            unsized << entry;
+        }
+    }
+
+    QSet<QByteArray> pngIds;
+    for (const auto &entry : entries) {
+        if (entry.offset == NotPacked) {
+            pngIds.insert(entry.id);
+        }
+    }
+
+    const auto files = QDir(imagesDir()).entryInfoList({ "*.png" }, QDir::Files);
+    for (const auto &fi : files) {
+        if (!pngIds.contains(fi.completeBaseName().toLatin1())) {
+            if (QFile::remove(fi.absoluteFilePath())) {
+                result.orphans++;
+                result.freedBytes += fi.size();
+            }
+        }
+    }
+
+    qint64 totalSize = 0;
+    for (const auto &entry : entries) {
+        totalSize += entry.size;
+    }
 
-    if (query.next()) {
-        const auto id = query.value((int)Column::ID).toString();
-        const auto hash = fileMd5Sum(svgPath);
-        const auto dbHash = query.value((int)Column::Hash).toByteArray();
-        const auto pngPath = query.value((int)Column::PngPath).toString();
+    if (budget > 0 && totalSize > budget) {
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return a.lastAccess < b.lastAccess;
+        });
 
-        if (dbHash == hash) {
-            return QImage(pngPath);
+        int count = 0;
+        while (totalSize > budget && count < entries.size()) {
+            const Entry &entry = entries.at(count);
+            if (entry.offset == NotPacked) {
+                QFile::remove(imagePath(entry.id));
+                result.freedBytes += entry.size;
+            }
+
+            removed << entry.id;
+            totalSize -= entry.size;
+            count++;
+        }
+
+        result.evicted = count;
+        entries.remove(0, count);
+    }
+
+    db.transaction();
+
+    query.prepare("DELETE FROM Images WHERE Key = :Key;");
+    for (const auto &id : removed) {
+        query.bindValue(":Key", id);
+        query.exec();
+        m_index.remove(id);
+    }
+
+    query.prepare("UPDATE Images SET Size = :Size WHERE Key = :Key;");
+    for (const auto &entry : unsized) {
+        query.bindValue(":Size", entry.size);
+        query.bindValue(":Key", entry.id);
+        query.exec();
+    }
+
+    db.commit();
+
+    // Frames of removed entries and frames that were never committed are dropped.
+    if (QFile::exists(packPath())) {
+        QHash<QByteArray, qint64> frames;
+        for (const auto &entry : entries) {
+            if (entry.offset != NotPacked) {
+                frames.insert(entry.id, entry.offset);
+            }
+        }
+
+        const qint64 oldSize = QFileInfo(packPath()).size();
+        if (pack()->compact(frames)) {
+            db.transaction();
+
+            query.prepare("UPDATE Images SET PackOffset = :PackOffset WHERE Key = :Key;");
+            for (auto it = frames.constBegin(); it != frames.constEnd(); ++it) {
+                query.bindValue(":PackOffset", it.value());
+                query.bindValue(":Key", it.key());
+                query.exec();
+                m_index.insert(it.key(), it.value());
+            }
+
+            db.commit();
+
+            result.freedBytes += oldSize - QFileInfo(packPath()).size();
         } else {
-            // Cache mismatch.
+            qWarning().noquote() << "cache: failed to compact" << PackFileName;
+        }
+    }
+
+    query.finish();
+    execQuery(query, "VACUUM;");
 
-            // Remove cached image.
-            QFile::remove(pngPath);
+    m_writer.reset(new CacheWriter(dbPath()));
 
-            // Remove from DB.
-            QSqlQuery query2(db);
-            query2.exec(QString("DELETE FROM Cache WHERE ID='%1';").arg(id));
+    return result;
+}
+
+int ImageCache::exportEntries(const QString &path, const QVector<Backend> &backends)
+{
+    QMutexLocker locker(&m_mutex);
+
+    QSaveFile file(path);
+    if (!file.open(QFile::WriteOnly)) {
+        throw QString("Failed to open '%1'.").arg(path);
+    }
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_6);
+    out << ArchiveMagic << ArchiveVersion;
+
+    QStringList names;
+    for (const auto backend : backends) {
+        names << backendToString(backend);
+    }
+
+    int count = 0;
+    QSqlQuery query(QSqlDatabase::database(DbName));
+    execQuery(query, "SELECT Key, Backend, Version, ViewSize FROM Images;");
+    while (query.next()) {
+        const auto id = query.value(0).toByteArray();
+        const auto backend = query.value(1).toString();
+        if (!names.contains(backend) || !m_index.contains(id)) {
+            continue;
         }
+
+        const QImage img = loadImage(id, m_index.value(id));
+        if (img.isNull()) {
+            continue;
+        }
+
+        // Each entry is prefixed with a flag, so the file can be written in a single pass.
+        out << true << id << backend << query.value(2).toString()
+            << qint32(query.value(3).toInt()) << img;
+        count++;
+    }
+
+    out << false;
+
+    if (out.status() != QDataStream::Ok || !file.commit()) {
+        throw QString("Failed to write '%1'.").arg(path);
     }
 
-    return QImage();
+    return count;
 }
 
-void ImageCache::setImage(const Backend backend, const QString &svgPath, const QImage &img)
+int ImageCache::importEntries(const QString &path)
 {
-    const auto imagesDir = Paths::workDir() + "/images";
+    QMutexLocker locker(&m_mutex);
 
-    if (!QDir().exists(imagesDir)) {
-        QDir().mkdir(imagesDir);
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        throw QString("Failed to open '%1'.").arg(path);
     }
 
-    const auto pngPath = imagesDir + '/' + QUuid::createUuid().toRfc4122().toHex() + ".png";
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_6);
 
-    img.save(pngPath);
+    quint32 magic = 0;
+    quint32 version = 0;
+    in >> magic >> version;
+    if (magic != ArchiveMagic || version != ArchiveVersion) {
+        throw QString("'%1' is not a vdiff cache file.").arg(path);
+    }
 
-    auto db = QSqlDatabase::database(DbName);
-    QSqlQuery query(db);
-    query.prepare("INSERT INTO Cache "
-                  "       ( SvgPath,  PngPath,  Backend,  Hash) "
-                  "VALUES (:SvgPath, :PngPath, :Backend, :Hash);");
-    query.bindValue(":SvgPath", svgPath);
-    query.bindValue(":PngPath", pngPath);
-    query.bindValue(":Backend", backendToString(backend));
-    query.bindValue(":Hash", fileMd5Sum(svgPath));
-    query.exec();
+    int count = 0;
+    while (true) {
+        bool hasEntry = false;
+        in >> hasEntry;
+        if (!hasEntry || in.status() != QDataStream::Ok) {
+            break;
+        }
+
+        QByteArray id;
+        QString backendName;
+        CacheKey key;
+        qint32 viewSize = 0;
+        QImage img;
+        in >> id >> backendName >> key.version >> viewSize >> img;
+        if (in.status() != QDataStream::Ok) {
+            break;
+        }
+
+        bool isKnown = false;
+        for (int i = 0; i < BackendsCount; ++i) {
+            if (backendToString((Backend)i) == backendName) {
+                key.backend = (Backend)i;
+                isKnown = true;
+            }
+        }
+
+        key.viewSize = viewSize;
+
+        if (isKnown && !img.isNull() && insertImage(id, key, img)) {
+            count++;
+        }
+    }
+
+    if (in.status() != QDataStream::Ok) {
+        throw QString("'%1' is damaged.").arg(path);
+    }
+
+    return count;
+}
+
+QByteArray ImageCache::fileHash(const QString &path)
+{
+    struct Entry
+    {
+        qint64 size;
+        QDateTime modified;
+        QByteArray hash;
+    };
+
+    static QMutex mutex;
+    static QHash<QString, Entry> hashes;
+
+    const QFileInfo fi(path);
+
+    {
+        QMutexLocker locker(&mutex);
+        const auto entry = hashes.value(path);
+        if (!entry.hash.isEmpty() && entry.size == fi.size()
+            && entry.modified == fi.lastModified())
+        {
+            return entry.hash;
+        }
+    }
+
+    // Files are hashed without the lock, so they can be hashed in parallel.
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        return QByteArray();
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(&file);
+
+    const Entry newEntry = { fi.size(), fi.lastModified(), hash.result().toHex() };
+
+    QMutexLocker locker(&mutex);
+    hashes.insert(path, newEntry);
+    return newEntry.hash;
 }
@@ -1,18 +1,115 @@
 #pragma once
 
+#include <QHash>
 #include <QImage>
+#include <QMap>
+#include <QMutex>
+#include <QVector>
+#include <QScopedPointer>
 
 #include "tests.h"
 
+class CacheWriter;
+class ImagePack;
+
+// Everything that affects a render.
+struct CacheKey
+{
+    QByteArray svgHash;
+    Backend backend;
+    // Identifies the renderer build.
+    QString version;
+    // In pixels, so it already accounts for the device pixel ratio.
+    int viewSize;
+    QString fontConfig;
+
+    // A content address of the render.
+    QByteArray id() const;
+};
+
+struct CacheStats
+{
+    struct Group
+    {
+        int entries;
+        qint64 bytes;
+    };
+
+    // Keyed by a backend name.
+    QMap<QString, Group> backends;
+    qint64 hits;
+    qint64 misses;
+    qint64 packSize;
+};
+
+struct CacheGcResult
+{
+    // Entries without an image.
+    int missing;
+    // Images without an entry.
+    int orphans;
+    int evicted;
+    qint64 freedBytes;
+};
+
+// A content-addressed storage of rendered images.
+//
+// Identical SVG files share entries. The index is loaded once,
+// so lookups don't touch the database. Thread-safe.
 class ImageCache
 {
 public:
     ImageCache();
     ~ImageCache();
 
-    QImage getImage(const Backend backend, const QString &svgPath);
-    void setImage(const Backend backend, const QString &svgPath, const QImage &img);
+    QImage getImage(const CacheKey &key);
+    void setImage(const CacheKey &key, const QImage &img);
+
+    // Stores new images as raw frames in a single memory-mapped file instead of PNG files.
+    // Such images are loaded without decoding and copying.
+    void setPackEnabled(const bool flag);
+
+    // Returns a hash of the file content.
+    //
+    // The result is reused until the file size or modification time changes.
+    static QByteArray fileHash(const QString &path);
+
+    CacheStats stats();
+
+    // Removes broken and orphaned entries and evicts the least recently used ones
+    // until the cache fits the budget. A zero budget disables eviction.
+    //
+    // Must not be run while other vdiff instances use the cache.
+    CacheGcResult collectGarbage(const qint64 budget);
+
+    // Writes entries of the specified backends to a single file.
+    //
+    // Entries are content-addressed and contain no paths, so the file can be imported
+    // on another machine. Such entries are used only when the renderer build matches.
+    //
+    // Returns the number of exported entries. Throws a QString on error.
+    int exportEntries(const QString &path, const QVector<Backend> &backends);
+
+    // Adds entries from a file created by exportEntries().
+    //
+    // Returns the number of imported entries. Throws a QString on error.
+    int importEntries(const QString &path);
 
 private:
     Q_DISABLE_COPY(ImageCache)
+
+    ImagePack* pack();
+    QImage loadImage(const QByteArray &id, const qint64 offset);
+    bool insertImage(const QByteArray &id, const CacheKey &key, const QImage &img);
+    void removeEntry(const QByteArray &id);
+
+private:
+    QMutex m_mutex;
+    // Maps a key to a frame offset in the pack file.
+    QHash<QByteArray, qint64> m_index;
+    QScopedPointer<ImagePack> m_pack;
+    QScopedPointer<CacheWriter> m_writer;
+    bool m_isPackEnabled = false;
+    qint64 m_hits = 0;
+    qint64 m_misses = 0;
 };
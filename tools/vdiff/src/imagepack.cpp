@@ -0,0 +1,255 @@
+#include <QDebug>
+#include <QHash>
+#include <QMap>
+
+#include <algorithm>
+#include <cstring>
+
+#include "imagepack.h"
+
+static const quint32 FrameMagic = 0x56444652; // VDFR
+static const int IdSize = 32;
+// Keeps pixel data aligned.
+static const int FrameAlignment = 16;
+
+struct FrameHeader
+{
+    quint32 magic;
+    quint32 format;
+    quint32 width;
+    quint32 height;
+    quint32 bytesPerLine;
+    char id[IdSize];
+    char reserved[12];
+};
+
+static_assert(sizeof(FrameHeader) % FrameAlignment == 0, "invalid header size");
+
+struct PackMapping
+{
+    ~PackMapping()
+    {
+        if (data) {
+            file.unmap(data);
+        }
+    }
+
+    QFile file;
+    uchar *data = nullptr;
+    qint64 size = 0;
+};
+
+static void releaseMapping(void *info)
+{
+    delete static_cast<QSharedPointer<PackMapping>*>(info);
+}
+
+ImagePack::ImagePack(const QString &path)
+    : m_file(path)
+    , m_lock(path + ".lock")
+{
+    if (!m_file.open(QFile::ReadWrite)) {
+        qWarning().noquote() << "cache: failed to open" << path;
+    }
+}
+
+ImagePack::~ImagePack()
+{
+}
+
+qint64 ImagePack::append(const QByteArray &id, const QImage &img)
+{
+    if (!m_file.isOpen() || id.size() != IdSize || img.isNull()) {
+        return -1;
+    }
+
+    // Only 32-bit images can be used by the diff directly.
+    const QImage frame = img.depth() == 32 ? img : img.convertToFormat(QImage::Format_ARGB32);
+
+    FrameHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = FrameMagic;
+    header.format = frame.format();
+    header.width = frame.width();
+    header.height = frame.height();
+    header.bytesPerLine = frame.bytesPerLine();
+    std::memcpy(header.id, id.constData(), IdSize);
+
+    // Other processes can append to the same file.
+    if (!m_lock.lock()) {
+        return -1;
+    }
+
+    const qint64 offset = m_file.size();
+    const qint64 dataSize = qint64(frame.bytesPerLine()) * frame.height();
+    const qint64 padding = (FrameAlignment - dataSize % FrameAlignment) % FrameAlignment;
+
+    bool ok = m_file.seek(offset);
+    ok = ok && m_file.write((const char*)&header, sizeof(header)) == sizeof(header);
+    ok = ok && m_file.write((const char*)frame.constBits(), dataSize) == dataSize;
+    ok = ok && m_file.write(QByteArray(padding, '\0')) == padding;
+    ok = ok && m_file.flush();
+
+    if (!ok) {
+        // Drop a partially written frame.
+        m_file.resize(offset);
+    }
+
+    m_lock.unlock();
+    return ok ? offset : -1;
+}
+
+QImage ImagePack::frame(const qint64 offset, const QByteArray &id)
+{
+    const qint64 headerEnd = offset + qint64(sizeof(FrameHeader));
+    if (offset < 0 || offset % FrameAlignment != 0 || headerEnd > m_file.size()) {
+        return QImage();
+    }
+
+    if ((!m_map || headerEnd > m_map->size) && !remap()) {
+        return QImage();
+    }
+
+    FrameHeader header;
+    std::memcpy(&header, m_map->data + offset, sizeof(header));
+
+    if (header.magic != FrameMagic || QByteArray(header.id, IdSize) != id) {
+        return QImage();
+    }
+
+    if (header.format == QImage::Format_Invalid || header.format >= QImage::NImageFormats) {
+        return QImage();
+    }
+
+    const auto format = (QImage::Format)header.format;
+    const qint64 dataSize = qint64(header.bytesPerLine) * header.height;
+    const bool isValid = QImage::toPixelFormat(format).bitsPerPixel() == 32
+                         && header.bytesPerLine >= header.width * 4
+                         && headerEnd + dataSize <= m_map->size;
+    if (!isValid) {
+        return QImage();
+    }
+
+    // The image is read-only and keeps the mapping alive.
+    const uchar *data = m_map->data + headerEnd;
+    return QImage(data, header.width, header.height, header.bytesPerLine, format,
+                  releaseMapping, new QSharedPointer<PackMapping>(m_map));
+}
+
+bool ImagePack::compact(QHash<QByteArray, qint64> &frames)
+{
+    if (!m_file.isOpen() || !m_lock.lock()) {
+        return false;
+    }
+
+    // Frames are moved towards the start of the file, so they are processed in order.
+    QMap<qint64, QByteArray> ordered;
+    QHash<qint64, qint64> sizes;
+    qint64 totalSize = 0;
+    for (auto it = frames.constBegin(); it != frames.constEnd(); ++it) {
+        const qint64 size = frameSize(it.value());
+        if (size == -1) {
+            m_lock.unlock();
+            return false;
+        }
+
+        ordered.insert(it.value(), it.key());
+        sizes.insert(it.value(), size);
+        totalSize += size;
+    }
+
+    // Frames never overlap, so there is nothing to remove.
+    if (totalSize == m_file.size()) {
+        m_lock.unlock();
+        return true;
+    }
+
+    // Moved frames would corrupt alive images, and a mapped file cannot be resized on Windows.
+    m_map.reset();
+    pruneMappings();
+    if (!m_mappings.isEmpty()) {
+        qWarning().noquote() << "cache:" << m_file.fileName() << "is in use";
+        m_lock.unlock();
+        return false;
+    }
+
+    QHash<QByteArray, qint64> newFrames;
+    qint64 newOffset = 0;
+    bool ok = true;
+    for (auto it = ordered.constBegin(); ok && it != ordered.constEnd(); ++it) {
+        const qint64 size = sizes.value(it.key());
+        if (it.key() != newOffset) {
+            ok = m_file.seek(it.key());
+            const QByteArray data = ok ? m_file.read(size) : QByteArray();
+            ok = ok && data.size() == size && m_file.seek(newOffset);
+            ok = ok && m_file.write(data) == size;
+        }
+
+        newFrames.insert(it.value(), newOffset);
+        newOffset += size;
+    }
+
+    ok = ok && m_file.flush() && m_file.resize(newOffset);
+
+    m_lock.unlock();
+
+    // On failure the old offsets are kept. Overwritten frames fail the id check.
+    if (ok) {
+        frames = newFrames;
+    }
+
+    return ok;
+}
+
+qint64 ImagePack::frameSize(const qint64 offset)
+{
+    const qint64 headerEnd = offset + qint64(sizeof(FrameHeader));
+    if (offset < 0 || offset % FrameAlignment != 0 || headerEnd > m_file.size()) {
+        return -1;
+    }
+
+    if ((!m_map || headerEnd > m_map->size) && !remap()) {
+        return -1;
+    }
+
+    FrameHeader header;
+    std::memcpy(&header, m_map->data + offset, sizeof(header));
+    if (header.magic != FrameMagic) {
+        return -1;
+    }
+
+    const qint64 dataSize = qint64(header.bytesPerLine) * header.height;
+    const qint64 padding = (FrameAlignment - dataSize % FrameAlignment) % FrameAlignment;
+    const qint64 size = qint64(sizeof(FrameHeader)) + dataSize + padding;
+    return offset + size <= m_map->size ? size : -1;
+}
+
+bool ImagePack::remap()
+{
+    // Previous mappings are kept by images that use them.
+    auto map = QSharedPointer<PackMapping>::create();
+    map->file.setFileName(m_file.fileName());
+    if (!map->file.open(QFile::ReadOnly) || map->file.size() == 0) {
+        return false;
+    }
+
+    map->size = map->file.size();
+    map->data = map->file.map(0, map->size);
+    if (!map->data) {
+        return false;
+    }
+
+    m_map = map;
+    pruneMappings();
+    m_mappings.append(map);
+    return true;
+}
+
+void ImagePack::pruneMappings()
+{
+    m_mappings.erase(std::remove_if(m_mappings.begin(), m_mappings.end(),
+                                    [](const QWeakPointer<PackMapping> &map){
+                                        return map.isNull();
+                                    }),
+                     m_mappings.end());
+}
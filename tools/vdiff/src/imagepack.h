@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QFile>
+#include <QImage>
+#include <QLockFile>
+#include <QSharedPointer>
+#include <QVector>
+#include <QWeakPointer>
+
+struct PackMapping;
+
+// An append-only file of raw image frames.
+//
+// Frames are read from a memory-mapped file, so returned images don't copy pixels.
+// A mapping stays alive while any image that references it exists.
+//
+// Appends are serialized between processes using a lock file.
+class ImagePack
+{
+public:
+    explicit ImagePack(const QString &path);
+    ~ImagePack();
+
+    // Returns the frame offset or -1 on error.
+    qint64 append(const QByteArray &id, const QImage &img);
+
+    // Returns a null image when there is no such frame.
+    QImage frame(const qint64 offset, const QByteArray &id);
+
+    // Rewrites the file in place, keeping only the specified frames, and updates their offsets.
+    //
+    // Fails when any previously returned image is still alive, because it points to the file.
+    bool compact(QHash<QByteArray, qint64> &frames);
+
+private:
+    Q_DISABLE_COPY(ImagePack)
+
+    bool remap();
+    void pruneMappings();
+    qint64 frameSize(const qint64 offset);
+
+private:
+    QFile m_file;
+    QLockFile m_lock;
+    QSharedPointer<PackMapping> m_map;
+    // Mappings that can still be used by images.
+    QVector<QWeakPointer<PackMapping>> m_mappings;
+};
@@ -1,9 +1,338 @@
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QJsonDocument>
+#include <QThread>
+
+#include "batch.h"
+#include "imagecache.h"
+#include "processscheduler.h"
+#include "renderworker.h"
+#include "settings.h"
+#include "stats.h"
+#include "testsindex.h"
 
 #include "mainwindow.h"
 
+static bool hasOption(int argc, char *argv[], const char *name)
+{
+    const int len = qstrlen(name);
+    for (int i = 1; i < argc; ++i) {
+        // Also matches the '--name=value' form.
+        if (qstrncmp(argv[i], name, len) == 0 && (argv[i][len] == '\0' || argv[i][len] == '=')) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Parses a comma-separated list of backend names.
+static bool parseBackends(const QString &text, QVector<Backend> &backends)
+{
+    for (const auto &name : text.split(',')) {
+        bool isFound = false;
+        for (int i = 0; i < BackendsCount; ++i) {
+            if (backendToString((Backend)i).compare(name, Qt::CaseInsensitive) == 0) {
+                backends << (Backend)i;
+                isFound = true;
+            }
+        }
+
+        if (!isFound) {
+            qCritical().noquote() << QString("Unknown backend: '%1'.").arg(name);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int runBatch(int argc, char *argv[])
+{
+    // Batch mode must work without a display.
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    // QGuiApplication is still required to draw error messages.
+    QGuiApplication app(argc, argv);
+    app.setOrganizationName("resvg");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Renders all tests and compares them with the reference.");
+    parser.addHelpOption();
+    parser.addOptions({
+        { "batch", "Run without GUI." },
+        { "output", "Report path.", "path", "vdiff-report.json" },
+        { "jobs", "Number of parallel jobs.", "n",
+          QString::number(QThread::idealThreadCount()) },
+        { "backends", "Comma-separated list of backends to use instead of the saved ones.",
+          "list" },
+        { "resvg-dir", "Path to the resvg repository.", "path" },
+        { "max-diff-pixels", "Amount of different pixels that is still treated as a match.",
+          "n", "0" },
+        { "no-cache", "Render everything, ignoring the cached images." },
+        { "backend-jobs", "Comma-separated list of per-backend limits of parallel renders, "
+                          "like 'batik=2,inkscape=2'. Zero disables the limit.", "list" },
+    });
+    parser.process(app);
+
+    Settings settings;
+    settings.load();
+
+    if (parser.isSet("resvg-dir")) {
+        settings.resvgDir = parser.value("resvg-dir");
+    }
+
+    if (parser.isSet("backends")) {
+        QVector<Backend> backends;
+        if (!parseBackends(parser.value("backends"), backends)) {
+            return 2;
+        }
+
+        for (int i = 0; i < BackendsCount; ++i) {
+            settings.setBackendEnabled((Backend)i, backends.contains((Backend)i));
+        }
+    }
+
+    if (parser.isSet("backend-jobs")) {
+        for (const auto &item : parser.value("backend-jobs").split(',')) {
+            const auto parts = item.split('=');
+            QVector<Backend> backends;
+            bool ok = parts.size() == 2;
+            const int limit = ok ? parts.at(1).toInt(&ok) : 0;
+            if (!ok || limit < 0) {
+                qCritical().noquote() << QString("Invalid backend limit: '%1'.").arg(item);
+                return 2;
+            }
+
+            if (!parseBackends(parts.at(0), backends)) {
+                return 2;
+            }
+
+            for (const Backend backend : backends) {
+                ProcessScheduler::instance().setLimit(backend, limit);
+            }
+        }
+    }
+
+    BatchOptions opt;
+    opt.outputPath = parser.value("output");
+    opt.jobs = qMax(1, parser.value("jobs").toInt());
+    opt.maxDiffPixels = parser.value("max-diff-pixels").toInt();
+    opt.useCache = !parser.isSet("no-cache");
+
+    const int code = Batch::run(settings, opt);
+    WorkerPool::shutdownAll();
+    RenderDaemon::shutdownAll();
+    return code;
+}
+
+// Parses sizes like '500M' or '2G'. Returns -1 on error.
+static qint64 parseSize(const QString &text)
+{
+    static const QString Suffixes = "KMG";
+
+    QString number = text.trimmed().toUpper();
+    qint64 scale = 1;
+    const int idx = number.isEmpty() ? -1 : Suffixes.indexOf(number.back());
+    if (idx != -1) {
+        number.chop(1);
+        scale = qint64(1) << (10 * (idx + 1));
+    }
+
+    bool ok = false;
+    const double value = number.toDouble(&ok);
+    return ok && value >= 0 ? qint64(value * scale) : -1;
+}
+
+static QString formatSize(const qint64 size)
+{
+    return QString("%1 MiB").arg(double(size) / (1024 * 1024), 0, 'f', 1);
+}
+
+static int runCacheMaintenance(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setOrganizationName("resvg");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Maintains the image cache.");
+    parser.addHelpOption();
+    parser.addOptions({
+        { "cache-stats", "Print cache statistics." },
+        { "cache-gc", "Remove broken and orphaned entries." },
+        { "cache-budget", "Evict the least recently used entries until the cache fits "
+                          "the size. Accepts K, M and G suffixes. Implies --cache-gc.", "size" },
+        { "cache-export", "Write cached images to a file that can be imported "
+                          "on another machine.", "path" },
+        { "cache-import", "Add cached images from a file.", "path" },
+        { "backends", "Comma-separated list of backends to export. All by default.", "list" },
+    });
+    parser.process(app);
+
+    qint64 budget = 0;
+    if (parser.isSet("cache-budget")) {
+        budget = parseSize(parser.value("cache-budget"));
+        if (budget <= 0) {
+            qCritical().noquote() << QString("Invalid cache budget: '%1'.")
+                                     .arg(parser.value("cache-budget"));
+            return 2;
+        }
+    }
+
+    QVector<Backend> backends;
+    if (parser.isSet("backends")) {
+        if (!parseBackends(parser.value("backends"), backends)) {
+            return 2;
+        }
+    } else {
+        for (int i = 0; i < BackendsCount; ++i) {
+            backends << (Backend)i;
+        }
+    }
+
+    Settings settings;
+    settings.load();
+
+    ImageCache cache;
+    // Imported images are stored the same way as rendered ones.
+    cache.setPackEnabled(settings.usePackCache);
+
+    try {
+        if (parser.isSet("cache-import")) {
+            const int count = cache.importEntries(parser.value("cache-import"));
+            qInfo().noquote() << QString("Imported %1 entries.").arg(count);
+        }
+
+        if (parser.isSet("cache-export")) {
+            const int count = cache.exportEntries(parser.value("cache-export"), backends);
+            qInfo().noquote() << QString("Exported %1 entries.").arg(count);
+        }
+    } catch (const QString &msg) {
+        qCritical().noquote() << msg;
+        return 1;
+    }
+
+    if (parser.isSet("cache-gc") || parser.isSet("cache-budget")) {
+        const auto result = cache.collectGarbage(budget);
+        qInfo().noquote() << QString("Removed %1 broken entries, %2 orphaned images "
+                                     "and evicted %3 entries. Freed %4.")
+                             .arg(result.missing).arg(result.orphans).arg(result.evicted)
+                             .arg(formatSize(result.freedBytes));
+    }
+
+    if (parser.isSet("cache-stats")) {
+        const auto stats = cache.stats();
+
+        int totalEntries = 0;
+        qint64 totalBytes = 0;
+        for (auto it = stats.backends.constBegin(); it != stats.backends.constEnd(); ++it) {
+            qInfo().noquote() << QString("%1: %2 entries, %3")
+                                 .arg(it.key(), -10).arg(it.value().entries)
+                                 .arg(formatSize(it.value().bytes));
+            totalEntries += it.value().entries;
+            totalBytes += it.value().bytes;
+        }
+
+        const qint64 lookups = stats.hits + stats.misses;
+        qInfo().noquote() << QString("Total: %1 entries, %2, pack file: %3")
+                             .arg(totalEntries).arg(formatSize(totalBytes))
+                             .arg(formatSize(stats.packSize));
+        qInfo().noquote() << QString("Hit rate: %1% (%2 of %3 lookups)")
+                             .arg(lookups ? 100.0 * stats.hits / lookups : 0.0, 0, 'f', 1)
+                             .arg(stats.hits).arg(lookups);
+    }
+
+    return 0;
+}
+
+static int runStats(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setOrganizationName("resvg");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Writes pass rate statistics of the saved results.");
+    parser.addHelpOption();
+    parser.addOptions({
+        { "stats", "Output path.", "path" },
+        { "resvg-dir", "Path to the resvg repository.", "path" },
+    });
+    parser.process(app);
+
+    Settings settings;
+    settings.load();
+    // Custom tests don't have results.
+    settings.testSuite = TestSuite::Own;
+
+    if (parser.isSet("resvg-dir")) {
+        settings.resvgDir = parser.value("resvg-dir");
+    }
+
+    Tests tests;
+    try {
+        tests = Tests::load(settings.testSuite, settings.resultsPath(), settings.testsPath());
+    } catch (const QString &msg) {
+        qCritical().noquote() << msg;
+        return 2;
+    }
+
+    // Titles are required to find SVG 2 tests.
+    QStringList paths;
+    for (const TestItem &item : tests) {
+        paths << item.path;
+    }
+
+    const auto updated = TestsIndex::refresh(paths);
+    for (int i = 0; i < tests.size(); ++i) {
+        auto &item = tests.at(i);
+        const auto it = updated.constFind(item.path);
+        if (it != updated.constEnd()) {
+            item.title = it->title;
+        }
+    }
+
+    const auto stats = SuiteStats::compute(tests);
+
+    QFile file(parser.value("stats"));
+    if (!file.open(QFile::WriteOnly)) {
+        qCritical().noquote() << QString("Failed to open %1.").arg(file.fileName());
+        return 2;
+    }
+
+    file.write(QJsonDocument(stats.toJson()).toJson());
+
+    for (int i = 0; i < BackendsCount; ++i) {
+        const auto backend = (Backend)i;
+        if (backend != Backend::Reference) {
+            qInfo().noquote() << QString("%1: %2 of %3 passed")
+                                 .arg(backendToString(backend), -10)
+                                 .arg(stats.all.passed.at(i)).arg(stats.all.total);
+        }
+    }
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
+    if (hasOption(argc, argv, "--batch")) {
+        return runBatch(argc, argv);
+    }
+
+    if (hasOption(argc, argv, "--stats")) {
+        return runStats(argc, argv);
+    }
+
+    for (const char *name : { "--cache-gc", "--cache-budget", "--cache-stats",
+                              "--cache-export", "--cache-import" }) {
+        if (hasOption(argc, argv, name)) {
+            return runCacheMaintenance(argc, argv);
+        }
+    }
+
     QApplication::setAttribute(Qt::AA_EnableHighDpiScaling);
 
     QApplication a(argc, argv);
@@ -13,5 +342,8 @@ int main(int argc, char *argv[])
     MainWindow w;
     w.show();
 
-    return a.exec();
+    const int code = a.exec();
+    WorkerPool::shutdownAll();
+    RenderDaemon::shutdownAll();
+    return code;
 }
@@ -1,26 +1,35 @@
 #include <QDir>
 #include <QFileDialog>
 #include <QFileInfo>
+#include <QLabel>
 #include <QMessageBox>
 #include <QPainter>
 #include <QScreen>
 #include <QScrollBar>
 #include <QShortcut>
+#include <QStatusBar>
 #include <QTimer>
+#include <QtConcurrent/QtConcurrentRun>
 
 #include "exportdialog.h"
 #include "backendwidget.h"
 #include "paths.h"
 #include "process.h"
+#include "processscheduler.h"
 #include "settingsdialog.h"
+#include "stats.h"
 
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 
+// Amount of tests after the current one that will be rendered in background.
+static const int PrefetchCount = 3;
+// Renders don't report their progress, so the queue is polled.
+static const int QueueUpdateInterval = 500; // ms
+
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
-    , m_autosaveTimer(new QTimer(this))
 {
     ui->setupUi(this);
 
@@ -34,19 +43,30 @@ MainWindow::MainWindow(QWidget *parent)
     connect(&m_render, &Render::imageReady, this, &MainWindow::onImageReady);
     connect(&m_render, &Render::diffReady, this, &MainWindow::onDiffReady);
     connect(&m_render, &Render::finished, this, &MainWindow::onRenderFinished);
+    connect(&m_indexWatcher, &QFutureWatcher<QHash<QString, TestsIndex::Entry>>::finished,
+            this, &MainWindow::onIndexRefreshed);
+
+    m_lblQueue = new QLabel(this);
+    statusBar()->addPermanentWidget(m_lblQueue);
 
-    connect(m_autosaveTimer, &QTimer::timeout, this, &MainWindow::save);
-    m_autosaveTimer->setInterval(30000); // 30 sec
-    m_autosaveTimer->start();
+    auto queueTimer = new QTimer(this);
+    connect(queueTimer, &QTimer::timeout, this, &MainWindow::updateQueueDepth);
+    queueTimer->start(QueueUpdateInterval);
 
     auto shortcutReload = new QShortcut(QKeySequence("Ctrl+R"), this);
     connect(shortcutReload, &QShortcut::activated, [this]() {
         const auto idx = ui->cmbBoxFiles->currentIndex();
         if (idx >= 0) {
+            // Backends may have been changed since the last render.
+            m_render.clearPrefetched();
             loadTest(idx);
         }
     });
 
+    // State changes are journaled, so saving only compacts them into the results file.
+    auto shortcutSave = new QShortcut(QKeySequence("Ctrl+S"), this);
+    connect(shortcutSave, &QShortcut::activated, this, &MainWindow::save);
+
     auto shortcutNext = new QShortcut(QKeySequence("Ctrl+N"), this);
     connect(shortcutNext, &QShortcut::activated, [this]() {
         const auto idx = ui->cmbBoxFiles->currentIndex();
@@ -64,6 +84,8 @@ MainWindow::~MainWindow()
 {
     save();
 
+    m_indexWatcher.waitForFinished();
+
     delete ui;
 }
 
@@ -196,21 +218,18 @@ void MainWindow::loadImageList(const TestSuite prevSuite)
 
 
     for (const TestItem &item : m_tests) {
-        QString title;
-        if (m_settings.testSuite == TestSuite::Own) {
-            auto dir = QDir(item.path);
-            dir.cdUp();
-            auto prefix = dir.dirName();
-            dir.cdUp();
-            prefix.prepend("/");
-            prefix.prepend(dir.dirName());
-
-            title = prefix + " - " + QString(item.title).replace('`', '\'');
-        } else {
-            title = item.baseName;
+        ui->cmbBoxFiles->addItem(itemTitle(item));
+    }
+
+    updateStats();
+
+    if (m_settings.testSuite == TestSuite::Own && !m_indexWatcher.isRunning()) {
+        QStringList paths;
+        for (const TestItem &item : m_tests) {
+            paths << item.path;
         }
 
-        ui->cmbBoxFiles->addItem(title);
+        m_indexWatcher.setFuture(QtConcurrent::run(TestsIndex::refresh, paths));
     }
 
     if (ui->cmbBoxFiles->count() != 0) {
@@ -226,6 +245,40 @@ void MainWindow::loadImageList(const TestSuite prevSuite)
     ui->cmbBoxFiles->setFocus();
 }
 
+QString MainWindow::itemTitle(const TestItem &item) const
+{
+    if (m_settings.testSuite != TestSuite::Own) {
+        return item.baseName;
+    }
+
+    auto dir = QDir(item.path);
+    dir.cdUp();
+    auto prefix = dir.dirName();
+    dir.cdUp();
+    prefix.prepend("/");
+    prefix.prepend(dir.dirName());
+
+    return prefix + " - " + QString(item.title).replace('`', '\'');
+}
+
+void MainWindow::onIndexRefreshed()
+{
+    if (m_settings.testSuite != TestSuite::Own) {
+        return;
+    }
+
+    // Tests may have been reloaded in the meantime, so entries are matched by path.
+    const auto updated = m_indexWatcher.result();
+    for (int i = 0; i < m_tests.size(); ++i) {
+        auto &item = m_tests.at(i);
+        const auto it = updated.constFind(item.path);
+        if (it != updated.constEnd() && it->title != item.title) {
+            item.title = it->title;
+            ui->cmbBoxFiles->setItemText(i, itemTitle(item));
+        }
+    }
+}
+
 void MainWindow::on_cmbBoxFiles_currentIndexChanged(int idx)
 {
     loadTest(idx);
@@ -241,6 +294,12 @@ void MainWindow::loadTest(const int idx)
 
     m_render.render(path);
 
+    QStringList nextPaths;
+    for (int i = idx + 1; i < qMin(idx + 1 + PrefetchCount, m_tests.size()); ++i) {
+        nextPaths << m_tests.at(i).path;
+    }
+    m_render.prefetch(nextPaths);
+
     setGuiEnabled(false);
 }
 
@@ -267,7 +326,7 @@ void MainWindow::fillChBoxes()
 
 void MainWindow::save()
 {
-    if (m_settings.testSuite != TestSuite::Custom) {
+    if (m_settings.testSuite != TestSuite::Custom && m_tests.isDirty()) {
         m_tests.save(m_settings.resultsPath());
     }
 }
@@ -276,16 +335,49 @@ void MainWindow::updatePassFlags()
 {
     try {
         const auto idx = ui->cmbBoxFiles->currentIndex();
-        auto &item = m_tests.at(idx);
+        if (m_settings.testSuite == TestSuite::Custom) {
+            return;
+        }
 
         for (auto *w : m_backendWidges.values()) {
-            item.state.insert(w->backend(), w->testState());
+            m_tests.setState(m_settings.resultsPath(), idx, w->backend(), w->testState());
         }
+
+        updateStats();
     } catch (const QString &msg) {
         QMessageBox::critical(this, "Error", msg);
     }
 }
 
+void MainWindow::updateStats()
+{
+    if (m_settings.testSuite == TestSuite::Custom) {
+        statusBar()->clearMessage();
+        return;
+    }
+
+    const auto stats = SuiteStats::compute(m_tests).all;
+
+    QStringList items;
+    for (int i = 0; i < BackendsCount; ++i) {
+        const auto backend = (Backend)i;
+        if (backend != Backend::Reference && m_backendWidges.contains(backend)) {
+            items << QString("%1 %2 (%3%)").arg(backendToString(backend))
+                     .arg(stats.passed.at(i)).arg(stats.rate(backend) * 100, 0, 'f', 1);
+        }
+    }
+
+    statusBar()->showMessage(QString("Tests: %1. Passed: %2")
+                             .arg(stats.total).arg(items.join(", ")));
+}
+
+void MainWindow::updateQueueDepth()
+{
+    // Includes prefetched tests.
+    const int depth = ProcessScheduler::instance().queueDepth();
+    m_lblQueue->setText(depth != 0 ? QString("Queued renders: %1").arg(depth) : QString());
+}
+
 void MainWindow::resetImages()
 {
     for (auto *w : m_backendWidges.values()) {
@@ -335,10 +427,31 @@ void MainWindow::on_btnSync_clicked()
     }
 
     try {
-        Tests::resync(m_settings);
+        const auto report = Tests::resync(m_settings);
+        m_render.clearPrefetched();
         loadImageList(m_settings.testSuite);
 
-        QMessageBox::information(this, "Info", "Tests was successfully synced.");
+        QStringList details;
+        for (const auto &name : report.added) {
+            details << "Added: " + name;
+        }
+
+        for (const auto &name : report.removed) {
+            details << "Removed: " + name;
+        }
+
+        for (const auto &names : report.renamed) {
+            details << QString("Renamed: %1 -> %2").arg(names.first, names.second);
+        }
+
+        QMessageBox msgBox(QMessageBox::Information, "Info",
+                           QString("Tests was successfully synced.\n\n"
+                                   "Added: %1, removed: %2, renamed: %3.")
+                           .arg(report.added.size()).arg(report.removed.size())
+                           .arg(report.renamed.size()),
+                           QMessageBox::Ok, this);
+        msgBox.setDetailedText(details.join('\n'));
+        msgBox.exec();
     } catch (const QString &msg) {
         QMessageBox::critical(this, "Error", msg);
     }
@@ -353,8 +466,6 @@ void MainWindow::on_btnSettings_clicked()
 
     SettingsDialog diag(&m_settings, this);
     if (diag.exec()) {
-        m_autosaveTimer->stop();
-
         m_render.setScale(qApp->screens().first()->devicePixelRatio());
 
         for (auto *w : m_backendWidges.values()) {
@@ -363,7 +474,6 @@ void MainWindow::on_btnSettings_clicked()
 
         prepareBackends();
         loadImageList(prevSuite);
-        m_autosaveTimer->start();
     }
 }
 
@@ -1,10 +1,12 @@
 #pragma once
 
+#include <QFutureWatcher>
 #include <QMainWindow>
 
 #include "settings.h"
 #include "tests.h"
 #include "render.h"
+#include "testsindex.h"
 
 namespace Ui {
 class MainWindow;
@@ -27,11 +29,14 @@ private:
     void prepareBackends();
     void setGuiEnabled(bool flag);
     void loadImageList(const TestSuite prevSuite);
+    QString itemTitle(const TestItem &item) const;
     void resetImages();
     void loadTest(const int idx);
     void setAnimationEnabled(bool flag);
     void fillChBoxes();
     void save();
+    void updateStats();
+    void updateQueueDepth();
 
 private slots:
     void onStart();
@@ -39,6 +44,7 @@ private slots:
     void onImageReady(const Backend type, const QImage &img);
     void onDiffReady(const Backend type, const QImage &img);
     void onRenderFinished();
+    void onIndexRefreshed();
     void updatePassFlags();
     void on_btnSync_clicked();
     void on_btnSettings_clicked();
@@ -46,11 +52,12 @@ private slots:
 
 private:
     Ui::MainWindow * const ui;
-    QTimer * const m_autosaveTimer;
 
     QHash<Backend, BackendWidget*> m_backendWidges;
+    QLabel *m_lblQueue = nullptr;
 
     Settings m_settings;
     Tests m_tests;
     Render m_render;
+    QFutureWatcher<QHash<QString, TestsIndex::Entry>> m_indexWatcher;
 };
@@ -1,8 +1,10 @@
+#include <QElapsedTimer>
 #include <QProcess>
 
 #include "process.h"
 
 QByteArray Process::run(const QString &name, const QStringList &args,
+                        const CancelToken &cancel,
                         bool mergeChannels, int validExitCodes)
 {
     QProcess proc;
@@ -18,8 +20,20 @@ QByteArray Process::run(const QString &name, const QStringList &args,
         throw QString("Process '%1' failed to start.").arg(fullCmd);
     }
 
-    if (!proc.waitForFinished(120000)) { // 2min
-        throw QString("Process '%1' was shutdown by timeout.").arg(fullCmd);
+    QElapsedTimer timer;
+    timer.start();
+
+    // Poll, so a cancelled process is killed right away.
+    while (proc.state() != QProcess::NotRunning && !proc.waitForFinished(100)) {
+        if (cancel.isCancelled()) {
+            proc.kill();
+            proc.waitForFinished();
+            throw QString("Process '%1' was cancelled.").arg(fullCmd);
+        }
+
+        if (timer.hasExpired(120000)) { // 2min
+            throw QString("Process '%1' was shutdown by timeout.").arg(fullCmd);
+        }
     }
 
     const QByteArray output = proc.readAll();
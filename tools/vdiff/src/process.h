@@ -2,10 +2,14 @@
 
 #include <QString>
 
+#include "canceltoken.h"
+
 class Process
 {
 public:
+    // The process is killed as soon as `cancel` is triggered.
     static QByteArray run(const QString &name, const QStringList &args,
+                          const CancelToken &cancel,
                           bool mergeChannels = false,
                           int validExitCode = 0);
 };
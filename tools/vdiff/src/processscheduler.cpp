@@ -0,0 +1,159 @@
+#include <QThread>
+#include <QThreadPool>
+
+#include "processscheduler.h"
+
+// How often waiting renders check for cancellation.
+static const int CancelCheckInterval = 100; // ms
+
+ProcessScheduler& ProcessScheduler::instance()
+{
+    static ProcessScheduler scheduler;
+    return scheduler;
+}
+
+ProcessScheduler::ProcessScheduler()
+{
+    const int cores = QThread::idealThreadCount();
+
+    for (int i = 0; i < BackendsCount; ++i) {
+        m_limits[i] = 0;
+        m_running[i] = 0;
+        for (int p = 0; p < RenderPrioritiesCount; ++p) {
+            m_waiting[i][p] = 0;
+        }
+    }
+
+    for (int p = 0; p < RenderPrioritiesCount; ++p) {
+        m_pools[p] = nullptr;
+    }
+
+    // Each render starts a browser page or a separate process with a large footprint.
+    m_limits[(int)Backend::Chrome]   = qMax(1, cores / 4);
+    m_limits[(int)Backend::Firefox]  = qMax(1, cores / 4);
+    m_limits[(int)Backend::Safari]   = qMax(1, cores / 4);
+    m_limits[(int)Backend::Batik]    = qMax(1, cores / 8);
+    m_limits[(int)Backend::Inkscape] = qMax(1, cores / 8);
+}
+
+void ProcessScheduler::setLimit(const Backend backend, const int limit)
+{
+    QMutexLocker locker(&m_mutex);
+    m_limits[(int)backend] = qMax(0, limit);
+    m_cond.wakeAll();
+}
+
+int ProcessScheduler::limit(const Backend backend) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_limits[(int)backend];
+}
+
+void ProcessScheduler::setThreadPool(const RenderPriority priority, QThreadPool *pool)
+{
+    QMutexLocker locker(&m_mutex);
+    m_pools[(int)priority] = pool;
+}
+
+bool ProcessScheduler::canStart(const int backend, const int priority) const
+{
+    const int limit = m_limits[backend];
+    if (limit != 0 && m_running[backend] >= limit) {
+        return false;
+    }
+
+    for (int p = 0; p < priority; ++p) {
+        if (m_waiting[backend][p] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ProcessScheduler::acquire(const Backend backend, const RenderPriority priority,
+                               const CancelToken &cancel)
+{
+    const int b = (int)backend;
+    const int p = (int)priority;
+
+    QMutexLocker locker(&m_mutex);
+    if (canStart(b, p)) {
+        m_running[b]++;
+        return true;
+    }
+
+    m_waiting[b][p]++;
+
+    QThreadPool *pool = m_pools[p];
+    if (pool) {
+        pool->releaseThread();
+    }
+
+    bool isCancelled = false;
+    while (!canStart(b, p)) {
+        if (cancel.isCancelled()) {
+            isCancelled = true;
+            break;
+        }
+
+        m_cond.wait(&m_mutex, CancelCheckInterval);
+    }
+
+    m_waiting[b][p]--;
+    if (!isCancelled) {
+        m_running[b]++;
+    }
+
+    if (pool) {
+        pool->reserveThread();
+    }
+
+    // Lower priority renders may be able to start now.
+    m_cond.wakeAll();
+
+    return !isCancelled;
+}
+
+void ProcessScheduler::release(const Backend backend)
+{
+    QMutexLocker locker(&m_mutex);
+    m_running[(int)backend]--;
+    m_cond.wakeAll();
+}
+
+int ProcessScheduler::queueDepth(const Backend backend) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    int depth = 0;
+    for (int p = 0; p < RenderPrioritiesCount; ++p) {
+        depth += m_waiting[(int)backend][p];
+    }
+
+    return depth;
+}
+
+int ProcessScheduler::queueDepth() const
+{
+    int depth = 0;
+    for (int i = 0; i < BackendsCount; ++i) {
+        depth += queueDepth((Backend)i);
+    }
+
+    return depth;
+}
+
+ProcessSlot::ProcessSlot(const Backend backend, const RenderPriority priority,
+                         const CancelToken &cancel)
+    : m_backend(backend)
+{
+    if (!ProcessScheduler::instance().acquire(backend, priority, cancel)) {
+        throw QString("%1 render was cancelled.").arg(backendToString(backend));
+    }
+}
+
+ProcessSlot::~ProcessSlot()
+{
+    ProcessScheduler::instance().release(m_backend);
+}
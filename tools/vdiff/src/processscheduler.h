@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include "canceltoken.h"
+#include "tests.h"
+
+class QThreadPool;
+
+enum class RenderPriority
+{
+    // The test a user is looking at.
+    Visible,
+    Prefetch,
+    Batch,
+};
+
+constexpr int RenderPrioritiesCount = 3;
+
+// Limits the amount of concurrent renders per backend.
+//
+// Backends like Batik and Inkscape start a JVM or a large application per render,
+// so running one per core can exhaust memory. When a backend is busy,
+// renders with a higher priority are started first.
+class ProcessScheduler
+{
+public:
+    static ProcessScheduler& instance();
+
+    // Zero disables the limit.
+    void setLimit(const Backend backend, const int limit);
+    int limit(const Backend backend) const;
+
+    // Renders of the priority run in this pool.
+    //
+    // While a render waits for a slot, its thread is not counted by the pool,
+    // so other backends can still use all threads.
+    void setThreadPool(const RenderPriority priority, QThreadPool *pool);
+
+    // Blocks until the backend has a free slot. Returns false when cancelled.
+    bool acquire(const Backend backend, const RenderPriority priority,
+                 const CancelToken &cancel);
+    void release(const Backend backend);
+
+    // The amount of renders waiting for a slot.
+    int queueDepth(const Backend backend) const;
+    int queueDepth() const;
+
+private:
+    ProcessScheduler();
+    Q_DISABLE_COPY(ProcessScheduler)
+
+    bool canStart(const int backend, const int priority) const;
+
+private:
+    mutable QMutex m_mutex;
+    QWaitCondition m_cond;
+    int m_limits[BackendsCount];
+    int m_running[BackendsCount];
+    int m_waiting[BackendsCount][RenderPrioritiesCount];
+    QThreadPool *m_pools[RenderPrioritiesCount];
+};
+
+// Holds a scheduler slot while alive.
+class ProcessSlot
+{
+public:
+    // Throws a QString when cancelled.
+    ProcessSlot(const Backend backend, const RenderPriority priority, const CancelToken &cancel);
+    ~ProcessSlot();
+
+private:
+    Q_DISABLE_COPY(ProcessSlot)
+
+    const Backend m_backend;
+};
@@ -1,58 +1,59 @@
+#include <QDir>
 #include <QFile>
 #include <QFileInfo>
 #include <QPainter>
+#include <QStandardPaths>
 #include <QImageReader>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QTimer>
 #include <QUrl>
-#include <QXmlStreamReader>
 #include <QtConcurrent/QtConcurrentMap>
 #include <QtConcurrent/QtConcurrentRun>
 
-#include <cmath>
-
+#include "diffkernel.h"
 #include "paths.h"
 #include "process.h"
+#include "renderworker.h"
 #include "imagecache.h"
+#include "svgmeta.h"
 
 #include "render.h"
 
-static QSize guessSvgSize(const QString &path)
+// Each render gets its own scratch directory, so the same backend
+// can render multiple images at the same time.
+// The directory is removed when it goes out of scope.
+static QString scratchTemplate()
 {
-    QFile file(path);
-    if (!file.open(QFile::ReadOnly)) {
-        return QSize();
-    }
-
-    QXmlStreamReader reader(&file);
-    if (!reader.readNextStartElement()) {
-        return QSize();
-    }
-
-    if (reader.name() != QLatin1String("svg")) {
-        return QSize();
-    }
-
-    const auto attributes = reader.attributes();
-    const auto viewBoxStr = attributes.value("viewBox");
-    const auto widthStr = attributes.value("width");
-    const auto heightStr = attributes.value("height");
+    return Paths::workDir() + "/render-XXXXXX";
+}
 
-    const auto vbValues = viewBoxStr.split(' ');
-    if (vbValues.size() != 4) {
-        return QSize();
+static QString scratchPath(const QTemporaryDir &dir, const QString &fileName)
+{
+    if (!dir.isValid()) {
+        throw QString("Failed to create a temporary directory: %1").arg(dir.errorString());
     }
 
-    auto width = widthStr.isEmpty() ? vbValues[2].toDouble() : widthStr.toDouble();
-    auto height = heightStr.isEmpty() ? vbValues[3].toDouble() : heightStr.toDouble();
-
-    return QSize(width, height);
+    return dir.path() + "/" + fileName;
 }
 
+// Amount of prefetched tests kept in memory.
+static const int PrefetchCacheSize = 16;
+
 Render::Render(QObject *parent)
     : QObject(parent)
 {
     qRegisterMetaType<RenderResult>("RenderResult");
     qRegisterMetaType<DiffOutput>("DiffOutput");
 
+    // Prefetch should not slow down the current test rendering.
+    m_prefetchPool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() / 2));
+
+    ProcessScheduler::instance().setThreadPool(RenderPriority::Visible,
+                                               QThreadPool::globalInstance());
+    ProcessScheduler::instance().setThreadPool(RenderPriority::Prefetch, &m_prefetchPool);
+    m_prefetched.setMaxCost(PrefetchCacheSize);
+
     connect(&m_watcher1, &QFutureWatcher<RenderResult>::resultReadyAt,
             this, &Render::onImageRendered);
     connect(&m_watcher1, &QFutureWatcher<RenderResult>::finished,
@@ -64,17 +65,179 @@ Render::Render(QObject *parent)
             this, &Render::onDiffFinished);
 }
 
+Render::~Render()
+{
+    m_cancel.cancel();
+
+    for (const auto &job : m_prefetching) {
+        job.cancel.cancel();
+    }
+
+    ProcessScheduler::instance().setThreadPool(RenderPriority::Prefetch, nullptr);
+}
+
 void Render::setScale(qreal s)
 {
     m_dpiScale = s;
     m_viewSize = m_settings->viewSize * s;
+
+    // Settings were changed.
+    clearPrefetched();
 }
 
 void Render::render(const QString &path)
 {
+    // Stop the previous test rendering.
+    m_cancel.cancel();
+    m_cancel = CancelToken();
+    m_watcher1.cancel();
+    m_watcher2.cancel();
+
     m_imgPath = path;
     m_imgs.clear();
-    renderImages();
+
+    if (m_prefetched.contains(path)) {
+        // Results must be emitted after this method returns, like for a usual render.
+        QTimer::singleShot(0, this, [this, path](){
+            deliverPrefetched(path);
+        });
+    } else {
+        // A prefetch job renders backends one by one and after the current test,
+        // so the test is rendered as usual. Images it has rendered so far are cached.
+        if (m_prefetching.contains(path)) {
+            cancelPrefetch(path);
+        }
+
+        renderImages();
+    }
+}
+
+void Render::prefetch(const QStringList &paths)
+{
+    for (const auto &path : m_prefetching.keys()) {
+        if (!paths.contains(path)) {
+            cancelPrefetch(path);
+        }
+    }
+
+    for (const auto &path : paths) {
+        if (m_prefetched.contains(path) || m_prefetching.contains(path)) {
+            continue;
+        }
+
+        PrefetchJob job;
+        job.watcher = new QFutureWatcher<PrefetchResult>(this);
+
+        auto watcher = job.watcher;
+        connect(watcher, &QFutureWatcher<PrefetchResult>::finished, this, [this, path, watcher](){
+            onPrefetchFinished(path, watcher);
+        });
+        connect(watcher, &QFutureWatcher<PrefetchResult>::finished,
+                watcher, &QObject::deleteLater);
+
+        // Settings are copied, because they can be changed while the job is running.
+        watcher->setFuture(QtConcurrent::run(&m_prefetchPool, &Render::renderTest, *m_settings,
+                                             path, m_viewSize, &m_imgCache, job.cancel));
+
+        m_prefetching.insert(path, job);
+    }
+}
+
+void Render::clearPrefetched()
+{
+    for (const auto &path : m_prefetching.keys()) {
+        cancelPrefetch(path);
+    }
+
+    m_prefetched.clear();
+}
+
+void Render::cancelPrefetch(const QString &path)
+{
+    m_prefetching.take(path).cancel.cancel();
+}
+
+void Render::deliverPrefetched(const QString &path)
+{
+    // A user switched to another test already.
+    if (path != m_imgPath) {
+        return;
+    }
+
+    const auto res = m_prefetched.object(path);
+    if (!res) {
+        // Was evicted.
+        renderImages();
+        return;
+    }
+
+    m_imgs = res->imgs;
+
+    for (auto it = res->imgs.constBegin(); it != res->imgs.constEnd(); ++it) {
+        emit imageReady(it.key(), it.value());
+    }
+
+    for (auto it = res->diffs.constBegin(); it != res->diffs.constEnd(); ++it) {
+        emit diffReady(it.key(), it.value());
+    }
+
+    emit finished();
+}
+
+void Render::onPrefetchFinished(const QString &path, QFutureWatcher<PrefetchResult> *watcher)
+{
+    // Was cancelled.
+    if (m_prefetching.value(path).watcher != watcher) {
+        return;
+    }
+
+    m_prefetching.remove(path);
+
+    m_prefetched.insert(path, new PrefetchResult(watcher->result()));
+}
+
+PrefetchResult Render::renderTest(const Settings &settings, const QString &path,
+                                  const int viewSize, ImageCache *cache,
+                                  const CancelToken &cancel)
+{
+    // Pool threads are used only by prefetch. Renderer processes are not affected,
+    // but they are started after the ones of the current test anyway.
+    QThread::currentThread()->setPriority(QThread::LowPriority);
+
+    PrefetchResult res;
+    const auto list = takeCached(settings, *cache,
+                                 prepareRenderData(settings, path, viewSize, cancel,
+                                                   RenderPriority::Prefetch),
+                                 res.imgs);
+
+    for (const RenderData &data : list) {
+        if (cancel.isCancelled()) {
+            return res;
+        }
+
+        const auto img = renderImage(data);
+        res.imgs.insert(img.type, img.img);
+
+        // Cached right away, so they are reused when the job is cancelled.
+        if (img.error.isEmpty()) {
+            const auto key = cacheKey(settings, img.type, path, viewSize);
+            if (!key.svgHash.isEmpty()) {
+                cache->setPackEnabled(settings.usePackCache);
+                cache->setImage(key, img.img);
+            }
+        }
+    }
+
+    for (const DiffData &data : prepareDiffData(settings.testSuite, res.imgs, cancel)) {
+        if (cancel.isCancelled()) {
+            return res;
+        }
+
+        const auto diff = diffImage(data);
+        res.diffs.insert(diff.type, diff.img);
+    }
+
+    return res;
 }
 
 QImage Render::renderReference(const RenderData &data)
@@ -96,32 +259,24 @@ QImage Render::renderReference(const RenderData &data)
 
 QImage Render::renderViaChrome(const RenderData &data)
 {
-    const auto outImg = Paths::workDir() + "/chrome.png";
-
-    const QString out = Process::run("node", {
+    // A single browser is shared by all renders.
+    return RenderDaemon::get("node", {
         QString(SRCDIR) + "../chrome-svgrender/svgrender.js",
-        data.imgPath,
-        outImg,
-        QString::number(data.viewSize)
-    }, true);
-
-    if (!out.isEmpty()) {
-        qDebug().noquote() << "chrome:" << out;
-    }
-
-    return loadImage(outImg);
+        "--server",
+    })->render(data.imgPath, InMemoryOutput, data.viewSize, data.cancel);
 }
 
 QImage Render::renderViaFirefox(const RenderData &data)
 {
-    const auto outImg = Paths::workDir() + "/firefox.png";
+    const QTemporaryDir dir(scratchTemplate());
+    const auto outImg = scratchPath(dir, "firefox.png");
 
     QString out = Process::run(data.convPath, {
         QString("--window-size=%1,%2").arg(data.viewSize).arg(data.viewSize),
         QString("--screenshot=%1").arg(QFileInfo(outImg).absoluteFilePath()),
         // The SVG file path must be formed as file:/// URL.
         QUrl::fromLocalFile(data.imgPath).toString(),
-    }, true);
+    }, data.cancel, true);
 
     if (!out.isEmpty()) {
         auto lines = out.split("\n");
@@ -154,14 +309,15 @@ QImage Render::renderViaFirefox(const RenderData &data)
 
 QImage Render::renderViaSafari(const RenderData &data)
 {
-    const auto outImg = Paths::workDir() + "/" + QFileInfo(data.imgPath).fileName() + ".png";
+    const QTemporaryDir dir(scratchTemplate());
+    const auto outImg = scratchPath(dir, QFileInfo(data.imgPath).fileName() + ".png");
 
     const QString out = Process::run("qlmanage", {
         "-t",
         "-s", QString::number(data.viewSize),
-        "-o", Paths::workDir(),
+        "-o", dir.path(),
         data.imgPath,
-    }, true);
+    }, data.cancel, true);
 
     auto image = loadImage(outImg);
 
@@ -174,33 +330,43 @@ QImage Render::renderViaSafari(const RenderData &data)
     return image;
 }
 
+static QString fontsDir()
+{
+    return QString(SRCDIR) + "../../fonts";
+}
+
+// Fonts used by the resvg test suite.
+static QStringList resvgFontArgs()
+{
+    return {
+        "--skip-system-fonts",
+        "--use-fonts-dir", fontsDir(),
+        "--font-family", "Noto Sans",
+        "--serif-family", "Noto Serif",
+        "--sans-serif-family", "Noto Sans",
+        "--cursive-family", "Yellowtail",
+        "--fantasy-family", "Sedgwick Ave Display",
+        "--monospace-family", "Noto Mono",
+    };
+}
+
 QImage Render::renderViaResvg(const RenderData &data)
 {
-    const QString outPath = Paths::workDir() + "/resvg.png";
+    const QTemporaryDir dir(scratchTemplate());
+    const QString outPath = scratchPath(dir, "resvg.png");
+
+    QStringList args = {
+        data.imgPath,
+        outPath,
+        "-w", QString::number(data.viewSize),
+    };
 
-    QString out;
     if (data.testSuite == TestSuite::Own) {
-        out = Process::run(data.convPath, {
-            data.imgPath,
-            outPath,
-            "-w", QString::number(data.viewSize),
-            "--skip-system-fonts",
-            "--use-fonts-dir", QString(SRCDIR) + "../../fonts",
-            "--font-family", "Noto Sans",
-            "--serif-family", "Noto Serif",
-            "--sans-serif-family", "Noto Sans",
-            "--cursive-family", "Yellowtail",
-            "--fantasy-family", "Sedgwick Ave Display",
-            "--monospace-family", "Noto Mono",
-        }, true);
-    } else {
-        out = Process::run(data.convPath, {
-            data.imgPath,
-            outPath,
-            "-w", QString::number(data.viewSize)
-        }, true);
+        args << resvgFontArgs();
     }
 
+    const QString out = Process::run(data.convPath, args, data.cancel, true);
+
     if (!out.isEmpty()) {
         qDebug().noquote() << "resvg:" << out;
     }
@@ -212,12 +378,13 @@ QImage Render::renderViaResvg(const RenderData &data)
 
 QImage Render::renderViaSvgNet(const RenderData &data)
 {
-    const auto outImg = Paths::workDir() + "/" + QFileInfo(data.imgPath).completeBaseName() + ".png";
+    const QTemporaryDir dir(scratchTemplate());
+    const auto outImg = scratchPath(dir, QFileInfo(data.imgPath).completeBaseName() + ".png");
 
     const QString out = Process::run(data.convPath, {
         data.imgPath,
         outImg
-    }, true);
+    }, data.cancel, true);
 
     if (!out.isEmpty()) {
         qDebug().noquote() << "svgnet:" << out;
@@ -228,7 +395,8 @@ QImage Render::renderViaSvgNet(const RenderData &data)
 
 QImage Render::renderViaBatik(const RenderData &data)
 {
-    const auto outImg = Paths::workDir() + "/batik.png";
+    const QTemporaryDir dir(scratchTemplate());
+    const auto outImg = scratchPath(dir, "batik.png");
 
     const QString out = Process::run(data.convPath, {
         "-scriptSecurityOff",
@@ -236,7 +404,7 @@ QImage Render::renderViaBatik(const RenderData &data)
         "-d", outImg,
         "-w", QString::number(data.viewSize),
         "-h", QString::number(data.viewSize),
-    }, true);
+    }, data.cancel, true);
 
     if (!out.contains("success")) {
         qDebug().noquote() << "batik:" << out;
@@ -255,26 +423,28 @@ QImage Render::renderViaBatik(const RenderData &data)
 
 QImage Render::renderViaInkscape(const RenderData &data)
 {
-    const auto outImg = Paths::workDir() + "/inkscape.png";
+    const QTemporaryDir dir(scratchTemplate());
+    const auto outImg = scratchPath(dir, "inkscape.png");
 
     /*const QString out = */Process::run(data.convPath, {
         data.imgPath,
         "-w", QString::number(data.viewSize),
         "--export-filename=" + outImg
-    });
+    }, data.cancel);
     return loadImage(outImg);
 }
 
 QImage Render::renderViaRsvg(const RenderData &data)
 {
-    const auto outImg = Paths::workDir() + "/rsvg.png";
+    const QTemporaryDir dir(scratchTemplate());
+    const auto outImg = scratchPath(dir, "rsvg.png");
 
     const QString out = Process::run(data.convPath, {
         "-f", "png",
         "-w", QString::number(data.viewSize),
         data.imgPath,
         "-o", outImg
-    });
+    }, data.cancel);
 
     if (!out.isEmpty()) {
         qDebug().noquote() << "rsvg:" << out;
@@ -287,89 +457,213 @@ QImage Render::renderViaRsvg(const RenderData &data)
 
 QImage Render::renderViaQtSvg(const RenderData &data)
 {
+    return WorkerPool::get(data.convPath, { "--server" })->render(data.imgPath, InMemoryOutput,
+                                                                 data.viewSize, data.cancel);
+}
+
+static QString converterPath(const Settings &settings, const Backend backend)
+{
+    switch (backend) {
 #ifdef Q_OS_WIN
-    const auto exePath = QString(SRCDIR) + "../qtsvgrender/release/qtsvgrender";
+        case Backend::QtSvg     : return QString(SRCDIR) + "../qtsvgrender/release/qtsvgrender";
 #else
-    const auto exePath = QString(SRCDIR) + "../qtsvgrender/qtsvgrender";
+        case Backend::QtSvg     : return QString(SRCDIR) + "../qtsvgrender/qtsvgrender";
 #endif
-    const auto outImg = Paths::workDir() + "/qtsvg.png";
-
-    const QString out = Process::run(exePath, {
-        data.imgPath,
-        outImg,
-        QString::number(data.viewSize)
-    }, true);
-
-    if (!out.isEmpty()) {
-        qDebug().noquote() << "qtsvg:" << out;
+        case Backend::Resvg     : return settings.resvgPath();
+        case Backend::Firefox   : return settings.firefoxPath;
+        case Backend::Batik     : return settings.batikPath;
+        case Backend::Inkscape  : return settings.inkscapePath;
+        case Backend::Librsvg   : return settings.librsvgPath;
+        default                 : return QString();
     }
-
-    return loadImage(outImg);
 }
 
-void Render::renderImages()
+QVector<RenderData> Render::prepareRenderData(const Settings &settings,
+                                             const QString &imgPath,
+                                             const int viewSize,
+                                             const CancelToken &cancel,
+                                             const RenderPriority priority)
 {
-    const auto ts = m_settings->testSuite;
-
-    QVector<RenderData> list;
+    const auto ts = settings.testSuite;
 
     // Parsing SVG using QtSvg directly is a bad idea, because it can crash.
-    auto imageSize = guessSvgSize(m_imgPath);
+    const QSizeF svgSize = SvgMeta::probe(imgPath).size;
+    auto imageSize = QSize(int(svgSize.width()), int(svgSize.height()));
     if (imageSize.isEmpty()) {
-        imageSize = QSize(m_viewSize, m_viewSize);
+        imageSize = QSize(viewSize, viewSize);
+    }
+    imageSize = imageSize * (float(viewSize) / imageSize.width());
+
+    // The order defines the order in which images will be rendered.
+    static const Backend Backends[] = {
+        Backend::Reference,
+        Backend::Resvg,
+        Backend::Chrome,
+        Backend::Firefox,
+        Backend::Safari,
+        Backend::Batik,
+        Backend::Inkscape,
+        Backend::Librsvg,
+        Backend::SvgNet,
+        Backend::QtSvg,
+    };
+
+    QVector<RenderData> list;
+    for (const Backend backend : Backends) {
+        if (settings.isBackendEnabled(backend)) {
+            list.append({ backend, viewSize, imageSize, imgPath, converterPath(settings, backend),
+                          ts, cancel, priority });
+        }
     }
-    imageSize = imageSize * (float(m_viewSize) / imageSize.width());
 
-    if (ts != TestSuite::Custom) {
-        list.append({ Backend::Reference, m_viewSize, imageSize, m_imgPath, QString(), ts });
+    return list;
+}
+
+QVector<DiffData> Render::prepareDiffData(const TestSuite testSuite,
+                                          const QHash<Backend, QImage> &imgs,
+                                          const CancelToken &cancel)
+{
+    // Custom test suite doesn't have reference images, so Chrome is used instead.
+    const auto refType = testSuite == TestSuite::Custom ? Backend::Chrome : Backend::Reference;
+    const QImage refImg = imgs.value(refType);
+
+    QVector<DiffData> list;
+    for (int t = (int)refType + 1; t <= (int)Backend::QtSvg; ++t) {
+        const auto type = (Backend)t;
+        if (imgs.contains(type)) {
+            list.append({ type, refImg, imgs.value(type), cancel });
+        }
     }
 
-    list.append({ Backend::Resvg, m_viewSize, imageSize, m_imgPath, m_settings->resvgPath(), ts });
+    return list;
+}
 
-    auto renderCached = [&](const Backend backend, const QString &renderPath) {
-        if (ts != TestSuite::Custom) {
-            const auto cachedImage = m_imgCache.getImage(backend, m_imgPath);
+QVector<RenderData> Render::takeCached(const Settings &settings, ImageCache &cache,
+                                      const QVector<RenderData> &list,
+                                      QHash<Backend, QImage> &imgs)
+{
+    QVector<RenderData> notCached;
+    for (const RenderData &data : list) {
+        const auto key = cacheKey(settings, data.type, data.imgPath, data.viewSize);
+        if (!key.svgHash.isEmpty()) {
+            const auto cachedImage = cache.getImage(key);
             if (!cachedImage.isNull()) {
-                m_imgs.insert(backend, cachedImage);
-                emit imageReady(backend, cachedImage);
-            } else {
-                list.append({ backend, m_viewSize, imageSize, m_imgPath, renderPath, ts });
+                imgs.insert(data.type, cachedImage);
+                continue;
             }
-        } else {
-            list.append({ backend, m_viewSize, imageSize, m_imgPath, renderPath, ts });
         }
-    };
 
-    if (m_settings->useChrome) {
-        renderCached(Backend::Chrome, QString());
+        notCached.append(data);
     }
 
-    if (m_settings->useFirefox) {
-        renderCached(Backend::Firefox, m_settings->firefoxPath);
+    return notCached;
+}
+
+static QString resolveExecutable(const QString &path)
+{
+    if (QFileInfo(path).isFile()) {
+        return path;
     }
 
-    if (m_settings->useSafari) {
-        renderCached(Backend::Safari, QString());
+#ifdef Q_OS_WIN
+    if (QFileInfo(path + ".exe").isFile()) {
+        return path + ".exe";
     }
+#endif
+
+    // Not a path, but a name.
+    return QStandardPaths::findExecutable(path);
+}
+
+// Describes fonts available to resvg, so renders are invalidated when fonts are changed.
+//
+// Doesn't depend on the checkout location, so cache entries can be shared between machines.
+static QString resvgFontConfig()
+{
+    static const QString config = [](){
+        QStringList items = resvgFontArgs();
+        items.removeAll(fontsDir());
+        for (const QFileInfo &fi : QDir(fontsDir()).entryInfoList(QDir::Files, QDir::Name)) {
+            items << QString("%1:%2").arg(fi.fileName())
+                                     .arg(QString(ImageCache::fileHash(fi.absoluteFilePath())));
+        }
+
+        return items.join(' ');
+    }();
+
+    return config;
+}
+
+// Identifies a renderer build, so its renders are invalidated after a rebuild or an update.
+//
+// Returns an empty string when the renderer cannot be identified.
+static QString rendererFingerprint(const Settings &settings, const Backend backend)
+{
+    QStringList files;
+    switch (backend) {
+        case Backend::Reference : return QString();
+        case Backend::Chrome :
+            // Puppeteer defines the Chrome version.
+            files << QString(SRCDIR) + "../chrome-svgrender/svgrender.js"
+                  << QString(SRCDIR) + "../chrome-svgrender/node_modules/puppeteer/package.json";
+            break;
+        case Backend::Safari : files << resolveExecutable("qlmanage"); break;
+        default : files << resolveExecutable(converterPath(settings, backend)); break;
+    }
+
+    QString fingerprint;
+    for (const auto &file : files) {
+        const auto hash = ImageCache::fileHash(file);
+        if (hash.isEmpty()) {
+            return QString();
+        }
 
-    if (m_settings->useBatik) {
-        renderCached(Backend::Batik, m_settings->batikPath);
+        fingerprint += hash;
     }
 
-    if (m_settings->useInkscape) {
-        renderCached(Backend::Inkscape, m_settings->inkscapePath);
+    return fingerprint;
+}
+
+CacheKey Render::cacheKey(const Settings &settings, const Backend backend,
+                          const QString &path, const int viewSize)
+{
+    const auto fingerprint = rendererFingerprint(settings, backend);
+    if (fingerprint.isEmpty()) {
+        return CacheKey();
     }
 
-    if (m_settings->useLibrsvg) {
-        list.append({ Backend::Librsvg, m_viewSize, imageSize, m_imgPath, m_settings->librsvgPath, ts });
+    CacheKey key;
+    key.svgHash = ImageCache::fileHash(path);
+    key.backend = backend;
+    key.version = fingerprint;
+    key.viewSize = viewSize;
+
+    // Fonts don't affect images without text.
+    const bool hasText = SvgMeta::features(path) & SvgMeta::Text;
+    if (backend == Backend::Resvg && settings.testSuite == TestSuite::Own && hasText) {
+        key.fontConfig = resvgFontConfig();
     }
 
-    if (m_settings->useSvgNet) {
-        renderCached(Backend::SvgNet, QString());
+    return key;
+}
+
+void Render::cacheImage(const Backend backend, const QString &path, const QImage &img)
+{
+    const auto key = cacheKey(*m_settings, backend, path, m_viewSize);
+    if (!key.svgHash.isEmpty()) {
+        m_imgCache.setPackEnabled(m_settings->usePackCache);
+        m_imgCache.setImage(key, img);
     }
+}
 
-    if (m_settings->useQtSvg) {
-        list.append({ Backend::QtSvg, m_viewSize, imageSize, m_imgPath, QString(), ts });
+void Render::renderImages()
+{
+    const auto list = takeCached(*m_settings, m_imgCache,
+                                 prepareRenderData(*m_settings, m_imgPath, m_viewSize, m_cancel),
+                                 m_imgs);
+
+    for (auto it = m_imgs.constBegin(); it != m_imgs.constEnd(); ++it) {
+        emit imageReady(it.key(), it.value());
     }
 
     const auto future = QtConcurrent::mapped(list, &Render::renderImage);
@@ -390,6 +684,8 @@ QImage Render::loadImage(const QString &path)
 RenderResult Render::renderImage(const RenderData &data)
 {
     try {
+        const ProcessSlot slot(data.type, data.priority, data.cancel);
+
         QImage img;
         switch (data.type) {
             case Backend::Reference   : img = renderReference(data); break;
@@ -404,7 +700,7 @@ RenderResult Render::renderImage(const RenderData &data)
             case Backend::QtSvg       : img = renderViaQtSvg(data); break;
         }
 
-        return { data.type, img };
+        return { data.type, img, QString() };
     } catch (const QString &s) {
         QImage img(data.viewSize, data.viewSize, QImage::Format_ARGB32);
         img.fill(Qt::white);
@@ -418,29 +714,21 @@ RenderResult Render::renderImage(const RenderData &data)
                    s);
         p.end();
 
-        return { data.type, img };
+        return { data.type, img, s };
     } catch (...) {
         Q_UNREACHABLE();
     }
 }
 
-static QImage toRGBFormat(const QImage &img, const QColor &bg)
-{
-    QImage newImg(img.size(), QImage::Format_RGB32);
-    newImg.fill(bg);
-
-    QPainter p(&newImg);
-    p.drawImage(0, 0, img);
-    p.end();
-    return newImg;
-}
-
-static int colorDistance(const QColor &color1, const QColor &color2)
+// Returns an image that can be passed to DiffKernel directly.
+static QImage toDiffFormat(const QImage &img)
 {
-    const int rd = std::pow(color1.red() - color2.red(), 2);
-    const int gd = std::pow(color1.green() - color2.green(), 2);
-    const int bd = std::pow(color1.blue() - color2.blue(), 2);
-    return std::sqrt(rd + gd + bd);
+    switch (img.format()) {
+        case QImage::Format_RGB32 :
+        case QImage::Format_ARGB32 :
+        case QImage::Format_ARGB32_Premultiplied : return img;
+        default : return img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
 }
 
 DiffOutput Render::diffImage(const DiffData &data)
@@ -454,109 +742,81 @@ DiffOutput Render::diffImage(const DiffData &data)
         qWarning() << msg;
     }
 
-    Q_ASSERT(data.img1.format() == data.img2.format());
-
     const int w = qMin(data.img1.width(), data.img2.width());
     const int h = qMin(data.img1.height(), data.img2.height());
 
-    // We have to convert ARGB images to RGB one with a white background,
-    // because colorDistance() doesn't work with alpha.
-    //
-    // TODO: remove, because expensive.
-    const auto img1 = toRGBFormat(data.img1, Qt::white);
-    const auto img2 = toRGBFormat(data.img2, Qt::white);
+    // Images are composited on a white background by the diff kernel itself.
+    const auto img1 = toDiffFormat(data.img1);
+    const auto img2 = toDiffFormat(data.img2);
+    const bool premultiplied1 = img1.format() == QImage::Format_ARGB32_Premultiplied;
+    const bool premultiplied2 = img2.format() == QImage::Format_ARGB32_Premultiplied;
 
     QImage diffImg(data.img1.size(), QImage::Format_RGB32);
-    diffImg.fill(Qt::red);
 
-    for (int y = 0; y < h; ++y) {
-        auto s1 = (QRgb*)(img1.constScanLine(y));
-        auto s2 = (QRgb*)(img2.constScanLine(y));
-        auto s3 = (QRgb*)(diffImg.scanLine(y));
-
-        for (int x = 0; x < w; ++x) {
-            QRgb c1 = *s1;
-            QRgb c2 = *s2;
-
-            if (colorDistance(c1, c2) > 5) {
-                *s3 = qRgb(255, 0, 0);
-            } else {
-                *s3 = qRgb(255, 255, 255);
-            }
+    // Pixels outside of the common area are always different.
+    int diffPixels = qMax(data.img1.width() * data.img1.height(),
+                          data.img2.width() * data.img2.height()) - w * h;
+    if (diffPixels != 0) {
+        diffImg.fill(Qt::red);
+    }
 
-            s1++;
-            s2++;
-            s3++;
+    for (int y = 0; y < h; ++y) {
+        // The result will be discarded anyway.
+        if (data.cancel.isCancelled()) {
+            break;
         }
+
+        diffPixels += DiffKernel::diffScanline((const QRgb*)img1.constScanLine(y), premultiplied1,
+                                               (const QRgb*)img2.constScanLine(y), premultiplied2,
+                                               (QRgb*)diffImg.scanLine(y), w);
     }
 
-    return { data.type, diffImg };
+    return { data.type, diffImg, diffPixels };
 }
 
 void Render::onImageRendered(const int idx)
 {
+    // Belongs to the previous test.
+    if (m_watcher1.isCanceled()) {
+        return;
+    }
+
     const auto res = m_watcher1.resultAt(idx);
     m_imgs.insert(res.type, res.img);
     emit imageReady(res.type, res.img);
 
-    if (m_settings->testSuite != TestSuite::Custom) {
-        switch (res.type) {
-            case Backend::Chrome :
-            case Backend::Firefox :
-            case Backend::Safari :
-            case Backend::Batik :
-            case Backend::Inkscape : m_imgCache.setImage(res.type, m_imgPath, res.img); break;
-            default : break;
-        }
+    // Do not cache error messages.
+    if (res.error.isEmpty()) {
+        cacheImage(res.type, m_imgPath, res.img);
     }
 }
 
 void Render::onImagesRendered()
 {
-    if (m_settings->testSuite == TestSuite::Custom) {
-        // Use Chrome as a reference.
-
-        const QImage refImg = m_imgs.value(Backend::Chrome);
-
-        QVector<DiffData> list;
-        const auto append = [&](const Backend type){
-            if (m_imgs.contains(type) && type != Backend::Chrome) {
-                list.append({ type, refImg, m_imgs.value(type) });
-            }
-        };
-
-        for (int t = (int)Backend::Firefox; t <= (int)Backend::QtSvg; ++t) {
-            append((Backend)t);
-        }
-
-        const auto future = QtConcurrent::mapped(list, &Render::diffImage);
-        m_watcher2.setFuture(future);
-    } else {
-        const QImage refImg = m_imgs.value(Backend::Reference);
-
-        QVector<DiffData> list;
-        const auto append = [&](const Backend type){
-            if (m_imgs.contains(type) && type != Backend::Reference) {
-                list.append({ type, refImg, m_imgs.value(type) });
-            }
-        };
-
-        for (int t = (int)Backend::Chrome; t <= (int)Backend::QtSvg; ++t) {
-            append((Backend)t);
-        }
-
-        const auto future = QtConcurrent::mapped(list, &Render::diffImage);
-        m_watcher2.setFuture(future);
+    if (m_watcher1.isCanceled()) {
+        return;
     }
+
+    const auto list = prepareDiffData(m_settings->testSuite, m_imgs, m_cancel);
+    const auto future = QtConcurrent::mapped(list, &Render::diffImage);
+    m_watcher2.setFuture(future);
 }
 
 void Render::onDiffResult(const int idx)
 {
+    if (m_watcher2.isCanceled()) {
+        return;
+    }
+
     const auto v = m_watcher2.resultAt(idx);
     emit diffReady(v.type, v.img);
 }
 
 void Render::onDiffFinished()
 {
+    if (m_watcher2.isCanceled()) {
+        return;
+    }
+
     emit finished();
 }
@@ -1,10 +1,14 @@
 #pragma once
 
 #include <QObject>
+#include <QCache>
 #include <QFutureWatcher>
 #include <QImage>
+#include <QThreadPool>
 
+#include "canceltoken.h"
 #include "imagecache.h"
+#include "processscheduler.h"
 #include "settings.h"
 
 struct RenderData
@@ -15,12 +19,15 @@ struct RenderData
     QString imgPath;
     QString convPath;
     TestSuite testSuite;
+    CancelToken cancel;
+    RenderPriority priority;
 };
 
 struct RenderResult
 {
     Backend type;
     QImage img;
+    QString error;
 };
 
 struct DiffData
@@ -28,12 +35,20 @@ struct DiffData
     Backend type;
     QImage img1;
     QImage img2;
+    CancelToken cancel;
 };
 
 struct DiffOutput
 {
     Backend type;
     QImage img;
+    int diffPixels;
+};
+
+struct PrefetchResult
+{
+    QHash<Backend, QImage> imgs;
+    QHash<Backend, QImage> diffs;
 };
 
 Q_DECLARE_METATYPE(RenderResult)
@@ -45,20 +60,58 @@ class Render : public QObject
 
 public:
     explicit Render(QObject *parent = nullptr);
+    ~Render();
 
     void setScale(qreal s);
 
     void render(const QString &path);
 
+    // Renders and diffs tests in background, so they can be shown instantly later.
+    // Jobs for tests that are not in the list anymore are cancelled.
+    void prefetch(const QStringList &paths);
+    void clearPrefetched();
+
     void setSettings(Settings *settings) { m_settings = settings; }
 
+    static QVector<RenderData> prepareRenderData(const Settings &settings,
+                                                 const QString &imgPath,
+                                                 const int viewSize,
+                                                 const CancelToken &cancel = CancelToken(),
+                                                 const RenderPriority priority
+                                                     = RenderPriority::Visible);
+    static QVector<DiffData> prepareDiffData(const TestSuite testSuite,
+                                             const QHash<Backend, QImage> &imgs,
+                                             const CancelToken &cancel = CancelToken());
+    // Returns a key with an empty SVG hash when the render cannot be cached.
+    static CacheKey cacheKey(const Settings &settings, const Backend backend,
+                             const QString &path, const int viewSize);
+    static RenderResult renderImage(const RenderData &data);
+    static DiffOutput diffImage(const DiffData &data);
+
 signals:
     void imageReady(Backend, QImage);
     void diffReady(Backend, QImage);
     void finished();
 
 private:
+    struct PrefetchJob
+    {
+        QFutureWatcher<PrefetchResult> *watcher;
+        CancelToken cancel;
+    };
+
     void renderImages();
+    void cacheImage(const Backend backend, const QString &path, const QImage &img);
+    void cancelPrefetch(const QString &path);
+    void deliverPrefetched(const QString &path);
+    void onPrefetchFinished(const QString &path, QFutureWatcher<PrefetchResult> *watcher);
+
+    static QVector<RenderData> takeCached(const Settings &settings, ImageCache &cache,
+                                          const QVector<RenderData> &list,
+                                          QHash<Backend, QImage> &imgs);
+    static PrefetchResult renderTest(const Settings &settings, const QString &path,
+                                     const int viewSize, ImageCache *cache,
+                                     const CancelToken &cancel);
 
     static QImage loadImage(const QString &path);
     static QImage renderReference(const RenderData &data);
@@ -71,8 +124,6 @@ private:
     static QImage renderViaInkscape(const RenderData &data);
     static QImage renderViaRsvg(const RenderData &data);
     static QImage renderViaQtSvg(const RenderData &data);
-    static RenderResult renderImage(const RenderData &data);
-    static DiffOutput diffImage(const DiffData &data);
 
 private slots:
     void onImageRendered(const int idx);
@@ -89,4 +140,9 @@ private:
     QFutureWatcher<DiffOutput> m_watcher2;
     QString m_imgPath;
     QHash<Backend, QImage> m_imgs;
+    // Triggered when the current test is switched.
+    CancelToken m_cancel;
+    QThreadPool m_prefetchPool;
+    QHash<QString, PrefetchJob> m_prefetching;
+    QCache<QString, PrefetchResult> m_prefetched;
 };
@@ -0,0 +1,506 @@
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QLocalSocket>
+#include <QProcess>
+#include <QThread>
+
+#include "renderworker.h"
+
+static const int Timeout = 120000; // 2min
+
+// Requests are tab-separated lines, so paths with tabs and line breaks cannot be sent.
+//
+// Returns an error message or an empty string on success.
+static QString checkRequestPaths(const QString &svgPath, const QString &pngPath)
+{
+    for (const QString &path : { svgPath, pngPath }) {
+        if (path.contains('\t') || path.contains('\n') || path.contains('\r')) {
+            return QString("Paths with tabs or line breaks are not supported: '%1'.").arg(path);
+        }
+    }
+
+    return QString();
+}
+
+static QByteArray makeRequest(const QString &svgPath, const QString &pngPath, int width)
+{
+    return QString("%1\t%2\t%3\n").arg(svgPath, pngPath).arg(width).toUtf8();
+}
+
+static bool isConnected(QIODevice *dev)
+{
+    if (auto proc = qobject_cast<QProcess*>(dev)) {
+        return proc->state() == QProcess::Running;
+    }
+
+    if (auto socket = qobject_cast<QLocalSocket*>(dev)) {
+        return socket->state() == QLocalSocket::ConnectedState;
+    }
+
+    return dev->isOpen();
+}
+
+// Waits in short steps to react to cancellation.
+static bool waitForReadyRead(QIODevice *dev, const CancelToken &cancel)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    while (!dev->waitForReadyRead(100)) {
+        if (cancel.isCancelled() || timer.hasExpired(Timeout) || !isConnected(dev)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool waitForBytes(QIODevice *dev, qint64 size, const CancelToken &cancel)
+{
+    while (dev->bytesAvailable() < size) {
+        if (!waitForReadyRead(dev, cancel)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool waitForLine(QIODevice *dev, const CancelToken &cancel)
+{
+    while (!dev->canReadLine()) {
+        if (!waitForReadyRead(dev, cancel)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Reads a reply to a single request.
+//
+// Returns false when the device was closed, timed out, the request was cancelled
+// or the reply is malformed. A malformed reply is described by `reply.error`.
+// Replies that follow it cannot be matched with requests anymore.
+static bool readReply(QIODevice *dev, RenderReply &reply, const CancelToken &cancel)
+{
+    if (!waitForLine(dev, cancel)) {
+        return false;
+    }
+
+    const auto line = QString::fromUtf8(dev->readLine()).trimmed();
+    const auto items = line.split(' ');
+
+    if (line == "ok") {
+        return true;
+    }
+
+    if (line.startsWith("error: ")) {
+        reply.error = line;
+        return true;
+    }
+
+    bool ok = false;
+    if (items.size() == 3 && items.at(0) == "raw") {
+        const int width = items.at(1).toInt(&ok);
+        const int height = ok ? items.at(2).toInt(&ok) : 0;
+        if (!ok || width < 0 || height < 0) {
+            reply.error = line;
+            return false;
+        }
+
+        const qint64 size = qint64(width) * height * 4;
+        if (!waitForBytes(dev, size, cancel)) {
+            return false;
+        }
+
+        QImage img(width, height, QImage::Format_ARGB32_Premultiplied);
+        if (img.isNull()) {
+            dev->read(size);
+            reply.error = QString("Invalid image size: %1x%2").arg(width).arg(height);
+            return true;
+        }
+
+        // ARGB32 images don't have a padding.
+        dev->read((char*)img.bits(), size);
+        reply.img = img;
+        return true;
+    }
+
+    if (items.size() == 2 && items.at(0) == "png") {
+        const qint64 size = items.at(1).toLongLong(&ok);
+        if (!ok || size < 0) {
+            reply.error = line;
+            return false;
+        }
+
+        if (!waitForBytes(dev, size, cancel)) {
+            return false;
+        }
+
+        if (!reply.img.loadFromData(dev->read(size), "PNG")) {
+            reply.error = "Invalid PNG data.";
+        }
+
+        return true;
+    }
+
+    reply.error = line;
+    return false;
+}
+
+RenderWorker::RenderWorker(const QString &program, const QStringList &args)
+    : m_program(program)
+    , m_args(args)
+{
+}
+
+QString RenderWorker::fullCmd() const
+{
+    return m_program + " " + m_args.join(" ");
+}
+
+RenderReply RenderWorker::render(const QString &svgPath, const QString &pngPath, int width,
+                                 const CancelToken &cancel)
+{
+    if (!m_proc) {
+        m_proc = new QProcess(this);
+    }
+
+    RenderReply reply;
+
+    reply.error = checkRequestPaths(svgPath, pngPath);
+    if (!reply.error.isEmpty()) {
+        return reply;
+    }
+
+    if (m_proc->state() != QProcess::Running) {
+        m_proc->start(m_program, m_args);
+        if (!m_proc->waitForStarted()) {
+            reply.error = QString("Process '%1' failed to start.").arg(fullCmd());
+            return reply;
+        }
+    }
+
+    m_proc->write(makeRequest(svgPath, pngPath, width));
+
+    if (!readReply(m_proc, reply, cancel)) {
+        if (cancel.isCancelled()) {
+            // The process is still busy with this request.
+            stop();
+            reply.error = QString("Process '%1' was cancelled.").arg(fullCmd());
+        } else if (!reply.error.isEmpty()) {
+            // The process is out of sync with requests.
+            stop();
+            reply.error = QString("Process '%1' sent an invalid reply: %2")
+                            .arg(fullCmd(), reply.error);
+        } else if (m_proc->state() == QProcess::Running) {
+            stop();
+            reply.error = QString("Process '%1' was shutdown by timeout.").arg(fullCmd());
+        } else {
+            reply.error = QString("Process '%1' was crashed:\n%2")
+                            .arg(fullCmd()).arg(QString(m_proc->readAllStandardError()));
+        }
+
+        return reply;
+    }
+
+    // Forward diagnostics, if any.
+    const auto stdErr = m_proc->readAllStandardError();
+    if (!stdErr.isEmpty()) {
+        qDebug().noquote() << m_program << ":" << stdErr;
+    }
+
+    return reply;
+}
+
+void RenderWorker::stop()
+{
+    if (!m_proc) {
+        return;
+    }
+
+    if (m_proc->state() != QProcess::NotRunning) {
+        m_proc->kill();
+        m_proc->waitForFinished();
+    }
+
+    // QProcess must be destroyed in the thread it was created in.
+    delete m_proc;
+    m_proc = nullptr;
+}
+
+static QMutex PoolsMutex;
+static QHash<QString, WorkerPool*> Pools;
+
+WorkerPool* WorkerPool::get(const QString &program, const QStringList &args)
+{
+    QMutexLocker locker(&PoolsMutex);
+
+    const auto key = program + " " + args.join(" ");
+    auto pool = Pools.value(key);
+    if (!pool) {
+        pool = new WorkerPool(program, args, QThread::idealThreadCount());
+        Pools.insert(key, pool);
+    }
+
+    return pool;
+}
+
+void WorkerPool::shutdownAll()
+{
+    QMutexLocker locker(&PoolsMutex);
+
+    qDeleteAll(Pools);
+    Pools.clear();
+}
+
+WorkerPool::WorkerPool(const QString &program, const QStringList &args, int maxWorkers)
+    : m_program(program)
+    , m_args(args)
+    , m_maxWorkers(qMax(1, maxWorkers))
+{
+    qRegisterMetaType<RenderReply>("RenderReply");
+    qRegisterMetaType<CancelToken>("CancelToken");
+}
+
+WorkerPool::~WorkerPool()
+{
+    for (int i = 0; i < m_workers.size(); ++i) {
+        QMetaObject::invokeMethod(m_workers.at(i), "stop", Qt::BlockingQueuedConnection);
+        m_threads.at(i)->quit();
+        m_threads.at(i)->wait();
+    }
+
+    qDeleteAll(m_workers);
+    qDeleteAll(m_threads);
+}
+
+QImage WorkerPool::render(const QString &svgPath, const QString &pngPath, int width,
+                          const CancelToken &cancel)
+{
+    if (cancel.isCancelled()) {
+        throw QString("Cancelled.");
+    }
+
+    auto worker = acquire();
+
+    RenderReply reply;
+    QMetaObject::invokeMethod(worker, "render", Qt::BlockingQueuedConnection,
+                              Q_RETURN_ARG(RenderReply, reply),
+                              Q_ARG(QString, svgPath),
+                              Q_ARG(QString, pngPath),
+                              Q_ARG(int, width),
+                              Q_ARG(CancelToken, cancel));
+
+    release(worker);
+
+    if (!reply.error.isEmpty()) {
+        throw reply.error;
+    }
+
+    if (pngPath == InMemoryOutput && reply.img.isNull()) {
+        throw QString("'%1' did not send an image.").arg(m_program);
+    }
+
+    return reply.img;
+}
+
+RenderWorker* WorkerPool::acquire()
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (m_idle.isEmpty()) {
+        if (m_workers.size() < m_maxWorkers) {
+            auto thread = new QThread();
+            auto worker = new RenderWorker(m_program, m_args);
+            worker->moveToThread(thread);
+            thread->start();
+
+            m_threads << thread;
+            m_workers << worker;
+            return worker;
+        }
+
+        m_cond.wait(&m_mutex);
+    }
+
+    return m_idle.takeLast();
+}
+
+void WorkerPool::release(RenderWorker *worker)
+{
+    QMutexLocker locker(&m_mutex);
+    m_idle << worker;
+    m_cond.wakeOne();
+}
+
+static QString makeServerName()
+{
+    static QAtomicInt counter;
+    const auto name = QString("vdiff-%1-%2")
+                        .arg(QCoreApplication::applicationPid())
+                        .arg(counter.fetchAndAddRelaxed(1));
+#ifdef Q_OS_WIN
+    return "\\\\.\\pipe\\" + name;
+#else
+    return QDir::tempPath() + "/" + name + ".sock";
+#endif
+}
+
+static QHash<QString, RenderDaemon*> Daemons;
+
+RenderDaemon* RenderDaemon::get(const QString &program, const QStringList &args)
+{
+    QMutexLocker locker(&PoolsMutex);
+
+    const auto key = program + " " + args.join(" ");
+    auto daemon = Daemons.value(key);
+    if (!daemon) {
+        daemon = new RenderDaemon(program, args);
+        Daemons.insert(key, daemon);
+    }
+
+    return daemon;
+}
+
+void RenderDaemon::shutdownAll()
+{
+    QMutexLocker locker(&PoolsMutex);
+
+    qDeleteAll(Daemons);
+    Daemons.clear();
+}
+
+RenderDaemon::RenderDaemon(const QString &program, const QStringList &args)
+    : m_program(program)
+    , m_args(args)
+    , m_serverName(makeServerName())
+    , m_thread(new QThread())
+{
+    moveToThread(m_thread);
+    m_thread->start();
+}
+
+RenderDaemon::~RenderDaemon()
+{
+    // The thread is stopped before the QObject destructor is called,
+    // so it's safe to delete the object from another thread.
+    QMetaObject::invokeMethod(this, "stop", Qt::BlockingQueuedConnection);
+    m_thread->quit();
+    m_thread->wait();
+    delete m_thread;
+}
+
+QString RenderDaemon::fullCmd() const
+{
+    return m_program + " " + m_args.join(" ");
+}
+
+QString RenderDaemon::start()
+{
+    if (m_proc && m_proc->state() == QProcess::Running) {
+        return QString();
+    }
+
+    // Restart after a crash.
+    stop();
+
+    m_proc = new QProcess(this);
+    // Diagnostics are printed as is, otherwise the stderr buffer will grow forever.
+    m_proc->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    m_proc->start(m_program, QStringList(m_args) << m_serverName);
+    if (!m_proc->waitForStarted()) {
+        return QString("Process '%1' failed to start.").arg(fullCmd());
+    }
+
+    while (!m_proc->canReadLine()) {
+        if (!m_proc->waitForReadyRead(Timeout)) {
+            const QString error = QString("Process '%1' failed to start:\n%2")
+                                    .arg(fullCmd()).arg(QString(m_proc->readAll()));
+            stop();
+            return error;
+        }
+    }
+
+    const auto reply = QString::fromUtf8(m_proc->readLine()).trimmed();
+    if (reply != "ready") {
+        stop();
+        return QString("Process '%1' failed to start:\n%2").arg(fullCmd(), reply);
+    }
+
+    return QString();
+}
+
+void RenderDaemon::stop()
+{
+    if (!m_proc) {
+        return;
+    }
+
+    if (m_proc->state() != QProcess::NotRunning) {
+        // Closing stdin allows the process to shutdown gracefully.
+        m_proc->closeWriteChannel();
+        if (!m_proc->waitForFinished(5000)) {
+            m_proc->kill();
+            m_proc->waitForFinished();
+        }
+    }
+
+    delete m_proc;
+    m_proc = nullptr;
+}
+
+QImage RenderDaemon::render(const QString &svgPath, const QString &pngPath, int width,
+                            const CancelToken &cancel)
+{
+    if (cancel.isCancelled()) {
+        throw QString("Cancelled.");
+    }
+
+    QString error = checkRequestPaths(svgPath, pngPath);
+    if (!error.isEmpty()) {
+        throw error;
+    }
+
+    QMetaObject::invokeMethod(this, "start", Qt::BlockingQueuedConnection,
+                              Q_RETURN_ARG(QString, error));
+    if (!error.isEmpty()) {
+        throw error;
+    }
+
+    QLocalSocket socket;
+    socket.connectToServer(m_serverName);
+    if (!socket.waitForConnected(Timeout)) {
+        throw QString("Failed to connect to '%1': %2").arg(fullCmd(), socket.errorString());
+    }
+
+    socket.write(makeRequest(svgPath, pngPath, width));
+
+    RenderReply reply;
+    if (!readReply(&socket, reply, cancel)) {
+        if (cancel.isCancelled()) {
+            throw QString("Cancelled.");
+        }
+
+        // Only this connection is out of sync, so the process is kept.
+        if (!reply.error.isEmpty()) {
+            throw QString("Process '%1' sent an invalid reply: %2").arg(fullCmd(), reply.error);
+        }
+
+        throw QString("Process '%1' did not reply: %2").arg(fullCmd(), socket.errorString());
+    }
+
+    if (!reply.error.isEmpty()) {
+        throw reply.error;
+    }
+
+    if (pngPath == InMemoryOutput && reply.img.isNull()) {
+        throw QString("'%1' did not send an image.").arg(fullCmd());
+    }
+
+    return reply.img;
+}
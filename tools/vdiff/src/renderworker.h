@@ -0,0 +1,137 @@
+#pragma once
+
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QStringList>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "canceltoken.h"
+
+class QIODevice;
+class QProcess;
+class QThread;
+
+// Output path that indicates that the image should be sent back instead of saved.
+static const QString InMemoryOutput = "-";
+
+struct RenderReply
+{
+    QString error;
+    QImage img;
+};
+
+Q_DECLARE_METATYPE(RenderReply)
+
+// A long-lived renderer process.
+//
+// The process reads requests from stdin, one per line:
+// `<svg path>\t<png path>\t<width>\n`
+// and replies with a single line per request: `ok` or `error: <message>`.
+// Paths cannot contain tabs and line breaks.
+//
+// When the png path is `-`, the image is sent back instead of `ok`, either as
+// `raw <width> <height>\n` followed by ARGB32_Premultiplied pixels
+// or as `png <size>\n` followed by PNG data.
+//
+// Each worker lives in its own thread, because QProcess cannot be used
+// from multiple threads.
+//
+// A worker is killed when a request is cancelled or its reply is malformed,
+// since the following replies cannot be matched with requests.
+class RenderWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    RenderWorker(const QString &program, const QStringList &args);
+
+    Q_INVOKABLE RenderReply render(const QString &svgPath, const QString &pngPath, int width,
+                                   const CancelToken &cancel);
+    Q_INVOKABLE void stop();
+
+private:
+    QString fullCmd() const;
+
+private:
+    const QString m_program;
+    const QStringList m_args;
+    QProcess *m_proc = nullptr;
+};
+
+// A pool of workers for a single renderer.
+//
+// Processes are started on demand and are reused between requests.
+class WorkerPool
+{
+public:
+    static WorkerPool* get(const QString &program, const QStringList &args);
+    static void shutdownAll();
+
+    // Blocks until the image is rendered.
+    // Returns the image when `pngPath` is `-` and a null image otherwise.
+    //
+    // Throws QString on error or when cancelled.
+    QImage render(const QString &svgPath, const QString &pngPath, int width,
+                  const CancelToken &cancel);
+
+private:
+    WorkerPool(const QString &program, const QStringList &args, int maxWorkers);
+    ~WorkerPool();
+    Q_DISABLE_COPY(WorkerPool)
+
+    RenderWorker* acquire();
+    void release(RenderWorker *worker);
+
+private:
+    const QString m_program;
+    const QStringList m_args;
+    const int m_maxWorkers;
+
+    QMutex m_mutex;
+    QWaitCondition m_cond;
+    QVector<RenderWorker*> m_workers;
+    QVector<RenderWorker*> m_idle;
+    QVector<QThread*> m_threads;
+};
+
+// A single long-lived renderer process that accepts concurrent requests on a local socket.
+//
+// The process is started with the socket path appended to the arguments and must print
+// `ready` to stdout once it accepts connections. Each connection uses the same protocol
+// as RenderWorker. The process must exit when its stdin is closed.
+//
+// A cancelled request only closes its connection. The process itself is shared.
+class RenderDaemon : public QObject
+{
+    Q_OBJECT
+
+public:
+    static RenderDaemon* get(const QString &program, const QStringList &args);
+    static void shutdownAll();
+
+    // Blocks until the image is rendered.
+    // Returns the image when `pngPath` is `-` and a null image otherwise.
+    //
+    // Throws QString on error or when cancelled.
+    QImage render(const QString &svgPath, const QString &pngPath, int width,
+                  const CancelToken &cancel);
+
+private:
+    RenderDaemon(const QString &program, const QStringList &args);
+    ~RenderDaemon();
+
+    // Returns an error message or an empty string on success.
+    Q_INVOKABLE QString start();
+    Q_INVOKABLE void stop();
+
+    QString fullCmd() const;
+
+private:
+    const QString m_program;
+    const QStringList m_args;
+    const QString m_serverName;
+    QThread * const m_thread;
+    QProcess *m_proc = nullptr;
+};
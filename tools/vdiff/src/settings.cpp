@@ -21,6 +21,7 @@ namespace Key {
     static const QString UseLibrsvg         = "UseLibrsvg";
     static const QString UseQtSvg           = "UseQtSvg";
     static const QString ViewSize           = "ViewSize";
+    static const QString PackCache          = "PackCache";
 }
 
 static QString testSuiteToStr(TestSuite t) noexcept
@@ -72,6 +73,7 @@ void Settings::load() noexcept
     this->useLibrsvg = appSettings.value(Key::UseLibrsvg).toBool();
     this->useSvgNet = appSettings.value(Key::UseSvgNet).toBool();
     this->useQtSvg = appSettings.value(Key::UseQtSvg).toBool();
+    this->usePackCache = appSettings.value(Key::PackCache).toBool();
 
     this->resvgDir = appSettings.value(Key::ResvgDir).toString();
     this->firefoxPath = appSettings.value(Key::FirefoxPath).toString();
@@ -95,6 +97,7 @@ void Settings::save() const noexcept
     appSettings.setValue(Key::UseLibrsvg, this->useLibrsvg);
     appSettings.setValue(Key::UseSvgNet, this->useSvgNet);
     appSettings.setValue(Key::UseQtSvg, this->useQtSvg);
+    appSettings.setValue(Key::PackCache, this->usePackCache);
     appSettings.setValue(Key::ResvgDir, this->resvgDir);
     appSettings.setValue(Key::FirefoxPath, this->firefoxPath);
     appSettings.setValue(Key::BatikPath, this->batikPath);
@@ -130,3 +133,37 @@ QString Settings::testsPath() const noexcept
     Q_ASSERT(QFile::exists(path));
     return QFileInfo(path).absoluteFilePath();
 }
+
+bool Settings::isBackendEnabled(const Backend backend) const noexcept
+{
+    switch (backend) {
+        case Backend::Reference : return this->testSuite != TestSuite::Custom;
+        case Backend::Chrome    : return this->useChrome;
+        case Backend::Firefox   : return this->useFirefox;
+        case Backend::Safari    : return this->useSafari;
+        case Backend::Resvg     : return true;
+        case Backend::Batik     : return this->useBatik;
+        case Backend::Inkscape  : return this->useInkscape;
+        case Backend::Librsvg   : return this->useLibrsvg;
+        case Backend::SvgNet    : return this->useSvgNet;
+        case Backend::QtSvg     : return this->useQtSvg;
+    }
+
+    Q_UNREACHABLE();
+}
+
+void Settings::setBackendEnabled(const Backend backend, const bool flag) noexcept
+{
+    switch (backend) {
+        case Backend::Reference : break;
+        case Backend::Chrome    : this->useChrome = flag; break;
+        case Backend::Firefox   : this->useFirefox = flag; break;
+        case Backend::Safari    : this->useSafari = flag; break;
+        case Backend::Resvg     : break;
+        case Backend::Batik     : this->useBatik = flag; break;
+        case Backend::Inkscape  : this->useInkscape = flag; break;
+        case Backend::Librsvg   : this->useLibrsvg = flag; break;
+        case Backend::SvgNet    : this->useSvgNet = flag; break;
+        case Backend::QtSvg     : this->useQtSvg = flag; break;
+    }
+}
@@ -20,11 +20,15 @@ public:
     QString resultsPath() const noexcept;
     QString testsPath() const noexcept;
 
+    bool isBackendEnabled(const Backend backend) const noexcept;
+    void setBackendEnabled(const Backend backend, const bool flag) noexcept;
+
 public:
     TestSuite testSuite = TestSuite::Own;
     BuildType buildType = BuildType::Debug;
     QString customTestsPath;
     int viewSize = 250;
+    bool usePackCache = false;
     bool useChrome = true;
     bool useFirefox = true;
     bool useSafari = true;
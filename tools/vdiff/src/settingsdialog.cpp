@@ -59,6 +59,8 @@ void SettingsDialog::loadSettings()
 
     ui->chBoxUseQtSvg->setChecked(m_settings->useQtSvg);
 
+    ui->chBoxPackCache->setChecked(m_settings->usePackCache);
+
     prepareTestsPathWidgets();
 }
 
@@ -95,6 +97,7 @@ void SettingsDialog::on_buttonBox_accepted()
     m_settings->useLibrsvg = ui->chBoxUseLibrsvg->isChecked();
     m_settings->useSvgNet = ui->chBoxUseSvgNet->isChecked();
     m_settings->useQtSvg = ui->chBoxUseQtSvg->isChecked();
+    m_settings->usePackCache = ui->chBoxPackCache->isChecked();
 
     m_settings->resvgDir = ui->lineEditResvg->text();
     m_settings->firefoxPath = ui->lineEditFirefox->text();
@@ -0,0 +1,82 @@
+#include "stats.h"
+
+PassRates PassRates::compute(const Tests &tests, const QVector<int> &rows)
+{
+    PassRates rates;
+    rates.total = rows.size();
+    rates.passed = tests.countStates(TestState::Passed, rows);
+    rates.failed = tests.countStates(TestState::Failed, rows);
+    rates.crashed = tests.countStates(TestState::Crashed, rows);
+    return rates;
+}
+
+QJsonObject PassRates::toJson() const
+{
+    QJsonObject backends;
+    for (int i = 0; i < BackendsCount; ++i) {
+        const auto backend = (Backend)i;
+        if (backend == Backend::Reference) {
+            continue;
+        }
+
+        QJsonObject json;
+        json["passed"] = passed.at(i);
+        json["failed"] = failed.at(i);
+        json["crashed"] = crashed.at(i);
+        json["rate"] = rate(backend);
+        backends[backendToString(backend)] = json;
+    }
+
+    QJsonObject json;
+    json["total"] = total;
+    json["backends"] = backends;
+    return json;
+}
+
+SuiteStats SuiteStats::compute(const Tests &tests)
+{
+    // Undefined behavior tests. Rows are sorted.
+    const auto skipped = tests.find({ { Backend::Chrome, TestState::Unknown } });
+
+    QVector<int> all;
+    QVector<int> svg2;
+    QMap<QString, QVector<int>> directories;
+    for (int row = 0, skippedIdx = 0; row < tests.size(); ++row) {
+        if (skippedIdx < skipped.size() && skipped.at(skippedIdx) == row) {
+            skippedIdx++;
+            continue;
+        }
+
+        const TestItem &item = tests.at(row);
+        all << row;
+
+        if (item.title.contains("(SVG 2)")) {
+            svg2 << row;
+        }
+
+        directories[item.baseName.left(item.baseName.lastIndexOf('/'))] << row;
+    }
+
+    SuiteStats stats;
+    stats.all = PassRates::compute(tests, all);
+    stats.svg2 = PassRates::compute(tests, svg2);
+    for (auto it = directories.constBegin(); it != directories.constEnd(); ++it) {
+        stats.directories.insert(it.key(), PassRates::compute(tests, it.value()));
+    }
+
+    return stats;
+}
+
+QJsonObject SuiteStats::toJson() const
+{
+    QJsonObject dirs;
+    for (auto it = directories.constBegin(); it != directories.constEnd(); ++it) {
+        dirs[it.key()] = it.value().toJson();
+    }
+
+    QJsonObject json;
+    json["all"] = all.toJson();
+    json["svg2"] = svg2.toJson();
+    json["directories"] = dirs;
+    return json;
+}
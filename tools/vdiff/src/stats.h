@@ -0,0 +1,42 @@
+#pragma once
+
+#include <QJsonObject>
+#include <QMap>
+#include <QVector>
+
+#include "tests.h"
+
+struct PassRates
+{
+    // Tests that are taken into account.
+    int total = 0;
+    // Indexed by Backend.
+    QVector<int> passed = QVector<int>(BackendsCount, 0);
+    QVector<int> failed = QVector<int>(BackendsCount, 0);
+    QVector<int> crashed = QVector<int>(BackendsCount, 0);
+
+    // In 0..1 range.
+    double rate(const Backend backend) const
+    { return total ? double(passed.at(int(backend))) / total : 0; }
+
+    static PassRates compute(const Tests &tests, const QVector<int> &rows);
+
+    QJsonObject toJson() const;
+};
+
+// Pass rate statistics of the test suite.
+//
+// Like `stats.py`, tests with an unknown Chrome state are skipped.
+struct SuiteStats
+{
+    PassRates all;
+    // Tests with '(SVG 2)' in the title.
+    PassRates svg2;
+    // Keyed by the directory part of a base name, like `structure/style`.
+    QMap<QString, PassRates> directories;
+
+    // Titles must be loaded to find SVG 2 tests.
+    static SuiteStats compute(const Tests &tests);
+
+    QJsonObject toJson() const;
+};
@@ -0,0 +1,470 @@
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QRectF>
+#include <QXmlStreamReader>
+
+#ifdef USE_QT_ZLIB
+#include <QtZlib/zlib.h>
+#else
+#include <zlib.h>
+#endif
+
+#include "svgmeta.h"
+
+// SVGZ files are small, so a larger one is probably not an SVG.
+static const qint64 MaxUncompressedSize = 64 * 1024 * 1024;
+// The root element and the title are at the start of a file.
+static const qint64 ProbeSize = 64 * 1024;
+
+static bool isGzip(const QByteArray &data)
+{
+    return data.size() > 2 && uchar(data.at(0)) == 0x1f && uchar(data.at(1)) == 0x8b;
+}
+
+// Decompresses up to `limit` bytes.
+static QByteArray gunzip(const QByteArray &data, const qint64 limit)
+{
+    z_stream stream = {};
+    // 16 enables the gzip header decoding.
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        return QByteArray();
+    }
+
+    stream.next_in = (Bytef*)data.constData();
+    stream.avail_in = data.size();
+
+    QByteArray out;
+    char buf[64 * 1024];
+    int res = Z_OK;
+    while (res == Z_OK && out.size() < limit) {
+        stream.next_out = (Bytef*)buf;
+        stream.avail_out = sizeof(buf);
+        res = inflate(&stream, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - stream.avail_out);
+    }
+
+    inflateEnd(&stream);
+    return res == Z_STREAM_END || out.size() >= limit ? out : QByteArray();
+}
+
+static bool isSpace(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool isNameEnd(const char c)
+{
+    return isSpace(c) || c == '>' || c == '/';
+}
+
+// Returns a position after the root element start tag name
+// or -1 when the prolog cannot be handled by a simple scanner.
+static int findRootElement(const QByteArray &data)
+{
+    int pos = 0;
+    while (true) {
+        pos = data.indexOf('<', pos);
+        if (pos == -1 || pos + 1 >= data.size()) {
+            return -1;
+        }
+
+        const char next = data.at(pos + 1);
+        if (next == '?') {
+            pos = data.indexOf("?>", pos);
+        } else if (data.mid(pos, 4) == "<!--") {
+            pos = data.indexOf("-->", pos);
+        } else if (next == '!') {
+            // An internal DTD subset can declare entities.
+            const int end = data.indexOf('>', pos);
+            const int subset = data.indexOf('[', pos);
+            if (subset != -1 && subset < end) {
+                return -1;
+            }
+
+            pos = end;
+        } else {
+            const int nameEnd = pos + 4;
+            const bool isSvg = data.mid(pos + 1, 3) == "svg" && nameEnd < data.size()
+                               && isNameEnd(data.at(nameEnd));
+            return isSvg ? nameEnd : -1;
+        }
+
+        if (pos == -1) {
+            return -1;
+        }
+    }
+}
+
+// Parses attributes of a start tag.
+//
+// `end` is set to the position of the tag end or -1 when there is none.
+static QHash<QByteArray, QByteArray> parseAttributes(const QByteArray &data, int pos, int &end)
+{
+    QHash<QByteArray, QByteArray> attrs;
+    while (pos < data.size()) {
+        while (pos < data.size() && isSpace(data.at(pos))) {
+            pos++;
+        }
+
+        if (pos >= data.size() || data.at(pos) == '>' || data.at(pos) == '/') {
+            break;
+        }
+
+        const int eq = data.indexOf('=', pos);
+        if (eq == -1) {
+            break;
+        }
+
+        const QByteArray name = data.mid(pos, eq - pos).trimmed();
+
+        int quote = eq + 1;
+        while (quote < data.size() && isSpace(data.at(quote))) {
+            quote++;
+        }
+
+        if (quote >= data.size() || (data.at(quote) != '"' && data.at(quote) != '\'')) {
+            break;
+        }
+
+        const int valueEnd = data.indexOf(data.at(quote), quote + 1);
+        if (valueEnd == -1) {
+            break;
+        }
+
+        attrs.insert(name, data.mid(quote + 1, valueEnd - quote - 1));
+        pos = valueEnd + 1;
+    }
+
+    end = data.indexOf('>', pos);
+    return attrs;
+}
+
+static QRectF parseViewBox(const QByteArray &text)
+{
+    QList<double> values;
+    for (const QByteArray &item : QByteArray(text).replace(',', ' ').simplified().split(' ')) {
+        bool ok = false;
+        values << item.toDouble(&ok);
+        if (!ok) {
+            return QRectF();
+        }
+    }
+
+    if (values.size() != 4 || values.at(2) <= 0 || values.at(3) <= 0) {
+        return QRectF();
+    }
+
+    return QRectF(values.at(0), values.at(1), values.at(2), values.at(3));
+}
+
+// Converts a length to pixels. `base` is used by percentages.
+//
+// Returns 0 when the length is not set or invalid.
+static double parseLength(const QByteArray &text, const double base)
+{
+    static const struct { const char *unit; double scale; } Units[] = {
+        { "px", 1.0 },
+        { "pt", 4.0 / 3.0 },
+        { "pc", 16.0 },
+        { "mm", 96.0 / 25.4 },
+        { "cm", 96.0 / 2.54 },
+        { "in", 96.0 },
+        // Relative to the default font size.
+        { "em", 16.0 },
+        { "ex", 8.0 },
+    };
+
+    const QByteArray value = text.trimmed();
+    if (value.isEmpty()) {
+        return 0;
+    }
+
+    QByteArray number = value;
+    double scale = 1.0;
+    if (value.endsWith('%')) {
+        number.chop(1);
+        scale = base / 100.0;
+    } else {
+        for (const auto &unit : Units) {
+            if (value.endsWith(unit.unit)) {
+                number.chop(2);
+                scale = unit.scale;
+                break;
+            }
+        }
+    }
+
+    bool ok = false;
+    const double n = number.toDouble(&ok);
+    return ok && n > 0 ? n * scale : 0;
+}
+
+// Decodes predefined entities and character references.
+static QString unescape(const QByteArray &text)
+{
+    static const struct { const char *name; char c; } Entities[] = {
+        { "lt", '<' },
+        { "gt", '>' },
+        { "quot", '"' },
+        { "apos", '\'' },
+        { "amp", '&' },
+    };
+
+    const QString s = QString::fromUtf8(text);
+    if (!s.contains('&')) {
+        return s;
+    }
+
+    QString out;
+    int pos = 0;
+    while (pos < s.size()) {
+        const int amp = s.indexOf('&', pos);
+        const int semicolon = amp == -1 ? -1 : s.indexOf(';', amp);
+        if (semicolon == -1) {
+            out += s.mid(pos);
+            break;
+        }
+
+        out += s.mid(pos, amp - pos);
+        pos = semicolon + 1;
+
+        const QString name = s.mid(amp + 1, semicolon - amp - 1);
+        if (name.startsWith('#')) {
+            bool ok = false;
+            const uint code = name.startsWith("#x") ? name.mid(2).toUInt(&ok, 16)
+                                                    : name.mid(1).toUInt(&ok, 10);
+            if (ok && code > 0 && code <= 0x10FFFF) {
+                if (QChar::requiresSurrogates(code)) {
+                    out += QChar(QChar::highSurrogate(code));
+                    out += QChar(QChar::lowSurrogate(code));
+                } else {
+                    out += QChar(code);
+                }
+
+                continue;
+            }
+        } else {
+            bool isFound = false;
+            for (const auto &entity : Entities) {
+                if (name == QLatin1String(entity.name)) {
+                    out += QLatin1Char(entity.c);
+                    isFound = true;
+                    break;
+                }
+            }
+
+            if (isFound) {
+                continue;
+            }
+        }
+
+        // Keep unknown references as is.
+        out += s.mid(amp, semicolon - amp + 1);
+    }
+
+    return out;
+}
+
+// Returns a position after the markup at `pos` that has no content, like a comment,
+// or -1 when there is no such markup.
+static int skipMarkup(const QByteArray &data, const int pos)
+{
+    static const struct { const char *start; const char *end; } Markup[] = {
+        { "<!--", "-->" },
+        { "<?", "?>" },
+    };
+
+    for (const auto &markup : Markup) {
+        if (data.mid(pos, qstrlen(markup.start)) == markup.start) {
+            const int end = data.indexOf(markup.end, pos);
+            return end == -1 ? data.size() : end + qstrlen(markup.end);
+        }
+    }
+
+    return -1;
+}
+
+// Reads the title when it's the first child element. `from` is the root start tag end.
+static QString findTitle(const QByteArray &data, const int from)
+{
+    int pos = from;
+    while ((pos = data.indexOf('<', pos)) != -1) {
+        const int next = skipMarkup(data, pos);
+        if (next == -1) {
+            break;
+        }
+
+        pos = next;
+    }
+
+    const int nameEnd = pos + 6;
+    if (pos == -1 || data.mid(pos, 6) != "<title" || nameEnd >= data.size()
+        || !isNameEnd(data.at(nameEnd)))
+    {
+        return QString();
+    }
+
+    const int start = data.indexOf('>', nameEnd);
+    if (start == -1 || data.at(start - 1) == '/') {
+        return QString();
+    }
+
+    // Text can be split by comments and CDATA sections.
+    QString title;
+    pos = start + 1;
+    while (true) {
+        const int end = data.indexOf('<', pos);
+        if (end == -1) {
+            // Truncated.
+            return QString();
+        }
+
+        title += unescape(data.mid(pos, end - pos));
+
+        if (data.mid(end, 9) == "<![CDATA[") {
+            const int cdataEnd = data.indexOf("]]>", end);
+            if (cdataEnd == -1) {
+                return QString();
+            }
+
+            title += QString::fromUtf8(data.mid(end + 9, cdataEnd - end - 9));
+            pos = cdataEnd + 3;
+        } else if (data.mid(end, 4) == "<!--") {
+            pos = skipMarkup(data, end);
+        } else {
+            // The title end or a child element.
+            return title;
+        }
+    }
+}
+
+// A fallback for files that cannot be handled by the scanner.
+static QHash<QByteArray, QByteArray> readRoot(const QByteArray &data, QString &title)
+{
+    QHash<QByteArray, QByteArray> attrs;
+
+    QXmlStreamReader reader(data);
+    if (!reader.readNextStartElement() || reader.name() != QLatin1String("svg")) {
+        return attrs;
+    }
+
+    for (const auto &attr : reader.attributes()) {
+        attrs.insert(attr.name().toUtf8(), attr.value().toUtf8());
+    }
+
+    if (reader.readNextStartElement() && reader.name() == QLatin1String("title")) {
+        title = reader.readElementText(QXmlStreamReader::SkipChildElements);
+    }
+
+    return attrs;
+}
+
+static SvgMeta parse(const QByteArray &data)
+{
+    SvgMeta meta;
+
+    QHash<QByteArray, QByteArray> attrs;
+    const int pos = findRootElement(data);
+    if (pos != -1) {
+        int end = -1;
+        attrs = parseAttributes(data, pos, end);
+        if (end != -1 && data.at(end - 1) != '/') {
+            meta.title = findTitle(data, end + 1);
+        }
+    } else {
+        attrs = readRoot(data, meta.title);
+    }
+
+    const QRectF viewBox = parseViewBox(attrs.value("viewBox"));
+
+    const double width = parseLength(attrs.value("width"), viewBox.width());
+    const double height = parseLength(attrs.value("height"), viewBox.height());
+    meta.size = QSizeF(width > 0 ? width : viewBox.width(),
+                       height > 0 ? height : viewBox.height());
+
+    return meta;
+}
+
+// Mapped files are read only as far as they are scanned, while SVGZ files are
+// decompressed up to `limit` bytes.
+//
+// The returned data references the file mapping.
+static QByteArray readFile(QFile &file, const qint64 limit)
+{
+    if (!file.open(QFile::ReadOnly) || file.size() == 0) {
+        return QByteArray();
+    }
+
+    const uchar *mapped = file.map(0, file.size());
+    const QByteArray data = mapped ? QByteArray::fromRawData((const char*)mapped, file.size())
+                                   : file.readAll();
+
+    return isGzip(data) ? gunzip(data, limit) : data;
+}
+
+// Reuses results until the file size or modification time changes.
+template<typename T>
+static T memoized(const QString &path, T (*read)(const QString &path))
+{
+    struct Entry
+    {
+        qint64 size;
+        QDateTime modified;
+        T value;
+    };
+
+    static QMutex mutex;
+    static QHash<QString, Entry> entries;
+
+    const QFileInfo fi(path);
+
+    {
+        QMutexLocker locker(&mutex);
+        const auto it = entries.constFind(path);
+        if (it != entries.constEnd() && it->size == fi.size()
+            && it->modified == fi.lastModified())
+        {
+            return it->value;
+        }
+    }
+
+    // Files are read without the lock, so they can be read in parallel.
+    const Entry entry = { fi.size(), fi.lastModified(), read(path) };
+
+    QMutexLocker locker(&mutex);
+    entries.insert(path, entry);
+    return entry.value;
+}
+
+static SvgMeta probeFile(const QString &path)
+{
+    QFile file(path);
+    return parse(readFile(file, ProbeSize));
+}
+
+static SvgMeta::Features scanFile(const QString &path)
+{
+    QFile file(path);
+    const QByteArray data = readFile(file, MaxUncompressedSize);
+
+    SvgMeta::Features features;
+    // Also matches textPath.
+    if (data.contains("<text")) {
+        features |= SvgMeta::Text;
+    }
+
+    return features;
+}
+
+SvgMeta SvgMeta::probe(const QString &path)
+{
+    return memoized(path, probeFile);
+}
+
+SvgMeta::Features SvgMeta::features(const QString &path)
+{
+    return memoized(path, scanFile);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <QSizeF>
+#include <QString>
+
+// Metadata of an SVG file.
+struct SvgMeta
+{
+    enum Feature
+    {
+        Text = 1 << 0,
+    };
+    Q_DECLARE_FLAGS(Features, Feature)
+
+    // In pixels. Empty when cannot be resolved.
+    QSizeF size;
+    QString title;
+
+    // Reads the root element and the title without parsing the whole file. Supports SVGZ.
+    //
+    // Results are reused until the file size or modification time changes.
+    static SvgMeta probe(const QString &path);
+
+    // Scans the whole file for elements that affect rendering results.
+    //
+    // Results are reused like the ones of probe().
+    static Features features(const QString &path);
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(SvgMeta::Features)
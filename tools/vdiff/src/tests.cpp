@@ -1,22 +1,34 @@
 #include <QFile>
+#include <QSaveFile>
 #include <QDir>
 #include <QDirIterator>
-#include <QXmlStreamReader>
 #include <QDebug>
+#include <QSet>
+#include <QtConcurrent/QtConcurrentMap>
 
+#include "imagecache.h"
 #include "settings.h"
+#include "testsindex.h"
 
 #include "tests.h"
 
-static TestState stateFormStr(const QString &str)
+#include <cstring>
+
+// Columns of the results file.
+static const struct { Backend backend; const char *name; } ResultsColumns[] = {
+    { Backend::Chrome,   "chrome" },
+    { Backend::Firefox,  "firefox" },
+    { Backend::Safari,   "safari" },
+    { Backend::Resvg,    "resvg" },
+    { Backend::Batik,    "batik" },
+    { Backend::Inkscape, "inkscape" },
+    { Backend::Librsvg,  "librsvg" },
+    { Backend::SvgNet,   "svgnet" },
+    { Backend::QtSvg,    "qtsvg" },
+};
+
+static TestState stateFromId(const int idx)
 {
-    bool ok = false;
-    const int idx = str.toInt(&ok);
-
-    if (!ok) {
-        throw QString("Invalid state ID: '%1'").arg(str);
-    }
-
     switch (idx) {
         case 0 : return TestState::Unknown;
         case 1 : return TestState::Passed;
@@ -28,38 +40,47 @@ static TestState stateFormStr(const QString &str)
     }
 }
 
-static QString parseTitle(const QString &path)
+static TestState stateFormStr(const QString &str)
 {
-    QFile file(path);
-    if (!file.open(QFile::ReadOnly)) {
-        return QString();
+    bool ok = false;
+    const int idx = str.toInt(&ok);
+
+    if (!ok) {
+        throw QString("Invalid state ID: '%1'").arg(str);
     }
 
-    QString title;
-    QXmlStreamReader reader(&file);
-    while (!reader.atEnd() && !reader.hasError()) {
-        if (reader.readNextStartElement()) {
-            if (reader.name() == QLatin1String("title")) {
-                reader.readNext();
-                title = reader.text().toString();
-                break;
-            }
-        }
+    return stateFromId(idx);
+}
+
+static QString journalPath(const QString &path)
+{
+    return path + ".journal";
+}
+
+// Returns the file name with two parent directories.
+static QString baseNameFromPath(const QString &path)
+{
+    int idx = path.size();
+    for (int i = 0; i < 3 && idx > 0; ++i) {
+        idx = path.lastIndexOf('/', idx - 1);
     }
 
-    return title;
+    return path.mid(idx + 1);
 }
 
 static QString resolveBaseName(const QFileInfo &info)
 {
-    auto baseName = info.fileName();
+    return baseNameFromPath(info.absoluteFilePath());
+}
 
-    auto dir = info.absoluteDir();
-    baseName.prepend(dir.dirName() + "/");
-    dir.cdUp();
-    baseName.prepend(dir.dirName() + "/");
+// Parses a state ID in place. Returns -1 on error.
+static int parseStateId(const char *begin, const char *end)
+{
+    if (end - begin != 1 || *begin < '0' || *begin > '9') {
+        return -1;
+    }
 
-    return baseName;
+    return *begin - '0';
 }
 
 Tests Tests::load(const TestSuite testSuite, const QString &path, const QString &testsPath)
@@ -69,60 +90,183 @@ Tests Tests::load(const TestSuite testSuite, const QString &path, const QString
         throw QString("Failed to open %1.").arg(path);
     }
 
-    const QString text = file.readAll();
+    // The file is tokenized in place, without creating a string per cell.
+    const qint64 fileSize = file.size();
+    const uchar *mapped = fileSize > 0 ? file.map(0, fileSize) : nullptr;
+    const QByteArray data = mapped ? QByteArray::fromRawData((const char*)mapped, fileSize)
+                                   : file.readAll();
 
     // A minimal csv parser.
     //
     // We don't care about escape characters, because they are not used.
 
-    Tests tests;
+    const char *pos = data.constData();
+    const char *const dataEnd = pos + data.size();
 
-    int row = 1;
-    for (const auto &line : text.split('\n')) {
-        // Skip title.
-        if (row == 1) {
-            row++;
-            continue;
+    const auto nextLine = [&pos, dataEnd]() {
+        const char *lineEnd = (const char*)std::memchr(pos, '\n', dataEnd - pos);
+        if (!lineEnd) {
+            lineEnd = dataEnd;
         }
 
-        if (line.isEmpty()) {
-            break;
+        const char *begin = pos;
+        pos = lineEnd == dataEnd ? dataEnd : lineEnd + 1;
+
+        // Allow CRLF.
+        if (lineEnd != begin && *(lineEnd - 1) == '\r') {
+            lineEnd--;
         }
 
-        const auto items = line.split(',');
+        return qMakePair(begin, lineEnd);
+    };
 
-        if (items.size() != BackendsCount) {
-            throw QString("Invalid columns count at row %1.").arg(row);
+    // Columns can be in any order. Missing ones are treated as unknown.
+    QVector<Backend> columns;
+    {
+        const auto header = nextLine();
+        const auto names = QByteArray(header.first, header.second - header.first).split(',');
+        if (names.isEmpty() || names.first() != "title") {
+            throw QString("Invalid header in %1.").arg(path);
+        }
+
+        for (int i = 1; i < names.size(); ++i) {
+            bool isFound = false;
+            for (const auto &column : ResultsColumns) {
+                if (names.at(i) == column.name) {
+                    if (columns.contains(column.backend)) {
+                        throw QString("Duplicated column '%1'.").arg(QString(names.at(i)));
+                    }
+
+                    columns << column.backend;
+                    isFound = true;
+                }
+            }
+
+            if (!isFound) {
+                throw QString("Unknown column '%1'.").arg(QString(names.at(i)));
+            }
+        }
+    }
+
+    Tests tests;
+
+    // Titles are taken from the index, so test files are not read.
+    // MainWindow refreshes outdated entries in background.
+    const auto index = testSuite == TestSuite::Own ? TestsIndex::load()
+                                                   : QHash<QString, TestsIndex::Entry>();
+
+    const QString testsDir = QDir(testsPath).absolutePath() + '/';
+
+    int row = 2;
+    while (pos != dataEnd) {
+        const auto line = nextLine();
+        if (line.first == line.second) {
+            break;
         }
 
-        const auto testPath = testsPath + '/' + items.at(0);
+        const char *cell = line.first;
+        const auto nextCell = [&cell, &line]() {
+            const char *cellEnd = (const char*)std::memchr(cell, ',', line.second - cell);
+            if (!cellEnd) {
+                cellEnd = line.second;
+            }
+
+            const char *begin = cell;
+            cell = cellEnd == line.second ? nullptr : cellEnd + 1;
+            return qMakePair(begin, cellEnd);
+        };
+
+        const auto name = nextCell();
 
         TestItem item;
-        item.path = QFileInfo(testPath).absoluteFilePath();
-        item.baseName = resolveBaseName(QFileInfo(testPath));
+        item.path = QDir::cleanPath(testsDir + QString::fromUtf8(name.first,
+                                                                 name.second - name.first));
+        item.baseName = baseNameFromPath(item.path);
 
-        item.state.insert(Backend::Chrome,      stateFormStr(items.at(1)));
-        item.state.insert(Backend::Firefox,     stateFormStr(items.at(2)));
-        item.state.insert(Backend::Safari,      stateFormStr(items.at(3)));
-        item.state.insert(Backend::Resvg,       stateFormStr(items.at(4)));
-        item.state.insert(Backend::Batik,       stateFormStr(items.at(5)));
-        item.state.insert(Backend::Inkscape,    stateFormStr(items.at(6)));
-        item.state.insert(Backend::Librsvg,     stateFormStr(items.at(7)));
-        item.state.insert(Backend::SvgNet,      stateFormStr(items.at(8)));
-        item.state.insert(Backend::QtSvg,       stateFormStr(items.at(9)));
+        for (const Backend backend : columns) {
+            if (!cell) {
+                throw QString("Invalid columns count at row %1.").arg(row);
+            }
 
-        if (testSuite == TestSuite::Own) {
-            item.title = parseTitle(testPath);
+            const auto value = nextCell();
+            const int id = parseStateId(value.first, value.second);
+            if (id == -1) {
+                throw QString("Invalid state ID at row %1: '%2'").arg(row)
+                      .arg(QString::fromUtf8(value.first, value.second - value.first));
+            }
+
+            item.state.insert(backend, stateFromId(id));
         }
 
+        if (cell) {
+            throw QString("Invalid columns count at row %1.").arg(row);
+        }
+
+        item.title = index.value(item.path).title;
+
         tests.m_data << item;
 
         row++;
     }
 
+    // Recovers changes that were not saved because of a crash.
+    tests.applyJournal(path);
+
     return tests;
 }
 
+void Tests::applyJournal(const QString &path)
+{
+    QFile file(journalPath(path));
+    if (!file.open(QFile::ReadOnly)) {
+        return;
+    }
+
+    QHash<QString, int> rows;
+    rows.reserve(m_data.size());
+    for (int i = 0; i < m_data.size(); ++i) {
+        rows.insert(m_data.at(i).baseName, i);
+    }
+
+    // Lines can be damaged after a crash, so invalid ones are skipped.
+    while (!file.atEnd()) {
+        const auto line = QString::fromUtf8(file.readLine());
+        if (!line.endsWith('\n')) {
+            qWarning().noquote() << QString("Skipped an incomplete journal line: '%1'.")
+                                    .arg(line);
+            break;
+        }
+
+        const auto items = line.trimmed().split(',');
+        bool ok = items.size() == 3;
+        const int backend = ok ? items.at(1).toInt(&ok) : -1;
+        const auto it = ok ? rows.constFind(items.at(0)) : rows.constEnd();
+
+        TestState state = TestState::Unknown;
+        if (ok) {
+            try {
+                state = stateFormStr(items.at(2));
+            } catch (const QString &) {
+                ok = false;
+            }
+        }
+
+        if (!ok || backend < 0 || backend >= BackendsCount) {
+            qWarning().noquote() << QString("Skipped an invalid journal line: '%1'.")
+                                    .arg(line.trimmed());
+            continue;
+        }
+
+        // A test was removed since.
+        if (it == rows.constEnd()) {
+            continue;
+        }
+
+        m_data[it.value()].state.insert((Backend)backend, state);
+        m_isDirty = true;
+    }
+}
+
 Tests Tests::loadCustom(const QString &path)
 {
     Tests tests;
@@ -150,69 +294,217 @@ Tests Tests::loadCustom(const QString &path)
 
 void Tests::save(const QString &path)
 {
-    QString text = "title,chrome,firefox,safari,resvg,batik,inkscape,librsvg,svgnet,qtsvg\n";
+    QByteArray text = "title";
+    for (const auto &column : ResultsColumns) {
+        text += ',';
+        text += column.name;
+    }
+    text += '\n';
+
+    // A base name and single digit states.
+    text.reserve(text.size() + m_data.size() * 64);
     for (const TestItem &item : m_data) {
-        text += item.baseName + ',';
-        text += QString::number((int)item.state.value(Backend::Chrome))     + ',';
-        text += QString::number((int)item.state.value(Backend::Firefox))    + ',';
-        text += QString::number((int)item.state.value(Backend::Safari))     + ',';
-        text += QString::number((int)item.state.value(Backend::Resvg))      + ',';
-        text += QString::number((int)item.state.value(Backend::Batik))      + ',';
-        text += QString::number((int)item.state.value(Backend::Inkscape))   + ',';
-        text += QString::number((int)item.state.value(Backend::Librsvg))    + ',';
-        text += QString::number((int)item.state.value(Backend::SvgNet))     + ',';
-        text += QString::number((int)item.state.value(Backend::QtSvg))      + '\n';
+        text += item.baseName.toUtf8();
+        for (const auto &column : ResultsColumns) {
+            text += ',';
+            text += char('0' + (int)item.state.value(column.backend));
+        }
+        text += '\n';
     }
 
-    QFile file(path);
+    // The previous file stays intact if writing fails.
+    QSaveFile file(path);
     if (!file.open(QFile::WriteOnly)) {
         throw QString("Failed to open %1.").arg(path);
     }
 
-    file.write(text.toUtf8());
+    file.write(text);
+
+    if (!file.commit()) {
+        throw QString("Failed to write %1.").arg(path);
+    }
+
+    QFile::remove(journalPath(path));
+    m_isDirty = false;
 }
 
-static void collectFilesRecursive(const QString &dir, QVector<QFileInfo> &files)
+void Tests::setState(const QString &path, const int row, const Backend backend,
+                     const TestState state)
 {
-    const auto infos = QDir(dir).entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot, QDir::Name);
-    for (const QFileInfo &fi : infos) {
-        if (fi.isDir()) {
-            collectFilesRecursive(fi.absoluteFilePath(), files);
-        } else if (fi.suffix() == "svg") {
-            files << fi;
+    auto &item = m_data[row];
+    if (item.state.value(backend) == state) {
+        return;
+    }
+
+    QFile file(journalPath(path));
+    if (!file.open(QFile::WriteOnly | QFile::Append)) {
+        throw QString("Failed to open %1.").arg(file.fileName());
+    }
+
+    const auto line = QString("%1,%2,%3\n").arg(item.baseName).arg((int)backend).arg((int)state);
+    file.write(line.toUtf8());
+
+    item.state.insert(backend, state);
+    m_isDirty = true;
+}
+
+static void collectFilesRecursive(const QFileInfo &fi, QStringList &files)
+{
+    if (!fi.isDir()) {
+        if (fi.suffix() == "svg") {
+            files << fi.absoluteFilePath();
         }
+
+        return;
+    }
+
+    const auto infos = QDir(fi.absoluteFilePath())
+                       .entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot, QDir::Name);
+    for (const QFileInfo &info : infos) {
+        collectFilesRecursive(info, files);
     }
 }
 
-void Tests::resync(const Settings &settings)
+// Returns SVG files sorted by name in depth-first order.
+static QStringList collectFiles(const QString &dir)
 {
-    QVector<QFileInfo> files;
-    collectFilesRecursive(settings.testsPath(), files);
+    const auto infos = QDir(dir).entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot, QDir::Name);
 
-    auto oldTests = load(settings.testSuite, settings.resultsPath(), settings.testsPath());
-    Tests newTests;
+    // Top-level entries are traversed in parallel. The order is preserved by blockingMapped.
+    const auto lists = QtConcurrent::blockingMapped<QVector<QStringList>>(infos,
+        [](const QFileInfo &fi) {
+            QStringList files;
+            collectFilesRecursive(fi, files);
+            return files;
+        });
+
+    QStringList files;
+    for (const auto &list : lists) {
+        files << list;
+    }
 
-    for (const QFileInfo &fi : files) {
-        const auto baseName = resolveBaseName(fi);
+    return files;
+}
 
-        bool isExists = false;
-        for (const TestItem &test : oldTests) {
-            if (test.baseName == baseName) {
-                isExists = true;
-                newTests.m_data << test;
-                break;
-            }
-        }
+ResyncReport Tests::resync(const Settings &settings)
+{
+    const auto files = collectFiles(settings.testsPath());
 
-        if (!isExists) {
+    const auto oldTests = load(settings.testSuite, settings.resultsPath(), settings.testsPath());
+
+    QHash<QString, int> oldIndex;
+    oldIndex.reserve(oldTests.size());
+    for (int i = 0; i < oldTests.size(); ++i) {
+        oldIndex.insert(oldTests.at(i).baseName, i);
+    }
+
+    ResyncReport report;
+    Tests newTests;
+    newTests.m_data.reserve(files.size());
+
+    // Indexes of new tests in newTests.
+    QVector<int> addedTests;
+    QSet<QString> newNames;
+    for (const QString &path : files) {
+        const auto baseName = resolveBaseName(QFileInfo(path));
+        newNames.insert(baseName);
+
+        const auto it = oldIndex.constFind(baseName);
+        if (it != oldIndex.constEnd()) {
+            newTests.m_data << oldTests.at(it.value());
+        } else {
             TestItem item;
-            item.path = fi.absoluteFilePath();
+            item.path = path;
             item.baseName = baseName;
+            addedTests << newTests.m_data.size();
             newTests.m_data << item;
         }
     }
 
+    // Removed files no longer exist, so their hashes are taken from the index.
+    const auto index = TestsIndex::load();
+    QHash<QByteArray, int> removedByHash;
+    for (int i = 0; i < oldTests.size(); ++i) {
+        const auto &test = oldTests.at(i);
+        if (!newNames.contains(test.baseName)) {
+            const auto hash = index.value(test.path).hash;
+            if (!hash.isEmpty()) {
+                removedByHash.insert(hash, i);
+            }
+        }
+    }
+
+    QStringList addedPaths;
+    for (const int idx : addedTests) {
+        addedPaths << newTests.m_data.at(idx).path;
+    }
+
+    const auto hashes = removedByHash.isEmpty()
+        ? QVector<QByteArray>(addedPaths.size())
+        : QtConcurrent::blockingMapped<QVector<QByteArray>>(addedPaths, ImageCache::fileHash);
+
+    QSet<QString> renamedNames;
+    for (int i = 0; i < addedTests.size(); ++i) {
+        auto &item = newTests.m_data[addedTests.at(i)];
+
+        const auto it = removedByHash.find(hashes.at(i));
+        if (hashes.at(i).isEmpty() || it == removedByHash.end()) {
+            report.added << item.baseName;
+            continue;
+        }
+
+        const auto &oldTest = oldTests.at(it.value());
+        item.title = oldTest.title;
+        item.state = oldTest.state;
+        report.renamed << qMakePair(oldTest.baseName, item.baseName);
+        renamedNames.insert(oldTest.baseName);
+        removedByHash.erase(it);
+    }
+
+    for (const auto &test : oldTests) {
+        if (!newNames.contains(test.baseName) && !renamedNames.contains(test.baseName)) {
+            report.removed << test.baseName;
+        }
+    }
+
     newTests.save(settings.resultsPath());
+
+    return report;
+}
+
+QVector<int> Tests::countStates(const TestState state, const QVector<int> &rows) const
+{
+    QVector<int> counts(BackendsCount, 0);
+    for (const int row : rows) {
+        const TestItem &item = m_data.at(row);
+        for (int i = 0; i < BackendsCount; ++i) {
+            if (item.state.value((Backend)i) == state) {
+                counts[i]++;
+            }
+        }
+    }
+
+    return counts;
+}
+
+QVector<int> Tests::find(std::initializer_list<QPair<Backend, TestState>> conditions) const
+{
+    // All conditions are checked with a single comparison per test.
+    TestStates pattern;
+    quint32 mask = 0;
+    for (const auto &condition : conditions) {
+        pattern.insert(condition.first, condition.second);
+        mask |= TestStates::mask(condition.first);
+    }
+
+    QVector<int> rows;
+    for (int i = 0; i < m_data.size(); ++i) {
+        if (m_data.at(i).state.matches(pattern, mask)) {
+            rows << i;
+        }
+    }
+
+    return rows;
 }
 
 static QString testSuiteToString(const TestSuite &t)
@@ -2,6 +2,10 @@
 
 #include <QVector>
 #include <QHash>
+#include <QPair>
+#include <QStringList>
+
+#include <initializer_list>
 
 class Settings;
 
@@ -43,12 +47,54 @@ enum class TestState
     Crashed,
 };
 
+// States of all backends packed into 2 bits each.
+class TestStates
+{
+public:
+    TestState value(const Backend backend) const
+    { return TestState((m_bits >> shift(backend)) & StateMask); }
+
+    void insert(const Backend backend, const TestState state)
+    {
+        m_bits &= ~(StateMask << shift(backend));
+        m_bits |= quint32(state) << shift(backend);
+    }
+
+    // Returns true when the states selected by `mask` are equal to the ones in `other`.
+    bool matches(const TestStates &other, const quint32 mask) const
+    { return ((m_bits ^ other.m_bits) & mask) == 0; }
+
+    // Returns a mask that selects the state of the backend.
+    static quint32 mask(const Backend backend) { return StateMask << shift(backend); }
+
+    bool operator==(const TestStates &other) const { return m_bits == other.m_bits; }
+    bool operator!=(const TestStates &other) const { return m_bits != other.m_bits; }
+
+private:
+    static const quint32 StateMask = 0x3;
+    static int shift(const Backend backend) { return int(backend) * 2; }
+
+private:
+    quint32 m_bits = 0;
+};
+
+static_assert(BackendsCount * 2 <= 32, "backend states don't fit");
+
 struct TestItem
 {
     QString path;
     QString baseName;
     QString title;
-    QHash<Backend, TestState> state;
+    TestStates state;
+};
+
+struct ResyncReport
+{
+    // Base names.
+    QStringList added;
+    QStringList removed;
+    // Old and new base names.
+    QVector<QPair<QString, QString>> renamed;
 };
 
 class Tests
@@ -56,9 +102,22 @@ class Tests
 public:
     static Tests load(const TestSuite testSuite, const QString &path, const QString &testsPath);
     static Tests loadCustom(const QString &path);
+
+    // Writes all results to a temporary file and replaces the results file with it.
     void save(const QString &path);
 
-    static void resync(const Settings &settings);
+    // Changes are appended to a journal next to the results file instead of rewriting it.
+    // The journal is applied by load() and removed by save().
+    void setState(const QString &path, const int row, const Backend backend,
+                  const TestState state);
+
+    // Indicates that the results file is outdated.
+    bool isDirty() const { return m_isDirty; }
+
+    // Updates the results file to match test files.
+    //
+    // Results of renamed files are preserved.
+    static ResyncReport resync(const Settings &settings);
 
     QVector<TestItem>::const_iterator begin() const { return m_data.begin(); }
     QVector<TestItem>::const_iterator end() const { return m_data.end(); }
@@ -68,6 +127,19 @@ public:
 
     int size() const { return m_data.size(); }
 
+    // Returns the amount of tests in `rows` with the state, indexed by Backend.
+    QVector<int> countStates(const TestState state, const QVector<int> &rows) const;
+
+    // Returns rows of tests that match all conditions.
+    //
+    // For example, `find({ { Backend::Resvg, TestState::Failed },
+    //                      { Backend::Chrome, TestState::Passed } })`.
+    QVector<int> find(std::initializer_list<QPair<Backend, TestState>> conditions) const;
+
+private:
+    void applyJournal(const QString &path);
+
 private:
     QVector<TestItem> m_data;
+    bool m_isDirty = false;
 };
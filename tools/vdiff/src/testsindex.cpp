@@ -0,0 +1,148 @@
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSaveFile>
+#include <QSet>
+#include <QtConcurrent/QtConcurrentMap>
+
+#include "imagecache.h"
+#include "paths.h"
+#include "svgmeta.h"
+
+#include "testsindex.h"
+
+static const quint32 IndexMagic = 0x56444958; // VDIX
+static const quint32 IndexVersion = 2;
+
+static QString indexPath()
+{
+    return Paths::workDir() + "/tests.index";
+}
+
+// Prevents concurrent refreshes from overwriting each other.
+static QMutex indexMutex;
+
+static QHash<QString, TestsIndex::Entry> loadIndex()
+{
+    QHash<QString, TestsIndex::Entry> index;
+
+    QFile file(indexPath());
+    if (!file.open(QFile::ReadOnly)) {
+        return index;
+    }
+
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_6);
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    qint32 count = 0;
+    in >> magic >> version >> count;
+    if (magic != IndexMagic || version != IndexVersion) {
+        return index;
+    }
+
+    index.reserve(count);
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        QString path;
+        TestsIndex::Entry entry;
+        in >> path >> entry.fileSize >> entry.modified >> entry.title >> entry.imageSize
+           >> entry.hash;
+        index.insert(path, entry);
+    }
+
+    // A damaged index is simply rebuilt.
+    if (in.status() != QDataStream::Ok) {
+        index.clear();
+    }
+
+    return index;
+}
+
+static void saveIndex(const QHash<QString, TestsIndex::Entry> &index)
+{
+    QSaveFile file(indexPath());
+    if (!file.open(QFile::WriteOnly)) {
+        return;
+    }
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_6);
+    out << IndexMagic << IndexVersion << qint32(index.size());
+
+    for (auto it = index.constBegin(); it != index.constEnd(); ++it) {
+        const auto &entry = it.value();
+        out << it.key() << entry.fileSize << entry.modified << entry.title << entry.imageSize
+            << entry.hash;
+    }
+
+    file.commit();
+}
+
+QHash<QString, TestsIndex::Entry> TestsIndex::load()
+{
+    QMutexLocker locker(&indexMutex);
+    return loadIndex();
+}
+
+QHash<QString, TestsIndex::Entry> TestsIndex::refresh(const QStringList &paths)
+{
+    QMutexLocker locker(&indexMutex);
+
+    auto index = loadIndex();
+
+    // Returns an empty path for up to date entries.
+    const auto probe = [&index](const QString &path) {
+        const QFileInfo fi(path);
+        // Removed files keep their entries until the next resync, which uses their hashes.
+        if (!fi.exists()) {
+            return qMakePair(QString(), Entry());
+        }
+
+        const qint64 modified = fi.lastModified().toMSecsSinceEpoch();
+
+        const auto it = index.constFind(path);
+        if (it != index.constEnd() && it->fileSize == fi.size() && it->modified == modified) {
+            return qMakePair(QString(), Entry());
+        }
+
+        const auto meta = SvgMeta::probe(path);
+        return qMakePair(path, Entry { fi.size(), modified, meta.title, meta.size,
+                                       ImageCache::fileHash(path) });
+    };
+
+    // Stat calls are slow on network file systems, so files are checked in parallel.
+    const auto results = QtConcurrent::blockingMapped<QVector<QPair<QString, Entry>>>(paths, probe);
+
+    QHash<QString, Entry> updated;
+    for (const auto &result : results) {
+        if (!result.first.isEmpty()) {
+            updated.insert(result.first, result.second);
+            index.insert(result.first, result.second);
+        }
+    }
+
+    QSet<QString> seen;
+    for (const auto &path : paths) {
+        seen.insert(path);
+    }
+
+    // Drop entries of tests that are no longer listed.
+    bool isPruned = false;
+    for (auto it = index.begin(); it != index.end();) {
+        if (seen.contains(it.key())) {
+            ++it;
+        } else {
+            it = index.erase(it);
+            isPruned = true;
+        }
+    }
+
+    if (!updated.isEmpty() || isPruned) {
+        saveIndex(index);
+    }
+
+    return updated;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <QHash>
+#include <QSizeF>
+#include <QString>
+#include <QStringList>
+
+// A persistent index of test file metadata.
+//
+// Allows showing titles without reading every test file on startup.
+namespace TestsIndex {
+    struct Entry
+    {
+        qint64 fileSize;
+        // In milliseconds since epoch.
+        qint64 modified;
+        QString title;
+        QSizeF imageSize;
+        // Allows finding renamed files.
+        QByteArray hash;
+    };
+
+    // Keyed by an absolute file path. Doesn't touch test files.
+    QHash<QString, Entry> load();
+
+    // Probes new and modified files in parallel and saves the index.
+    // Entries of paths that are not listed are removed.
+    //
+    // Returns only the updated entries.
+    QHash<QString, Entry> refresh(const QStringList &paths);
+};
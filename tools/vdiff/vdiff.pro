@@ -1,4 +1,4 @@
-QT      += core gui widgets concurrent sql
+QT      += core gui widgets concurrent sql network
 
 TARGET   = vdiff
 TEMPLATE = app
@@ -17,7 +17,16 @@ SOURCES  += \
     src/paths.cpp \
     src/settings.cpp \
     src/backendwidget.cpp \
-    src/imagecache.cpp
+    src/imagecache.cpp \
+    src/batch.cpp \
+    src/diffkernel.cpp \
+    src/renderworker.cpp \
+    src/imagepack.cpp \
+    src/cachewriter.cpp \
+    src/svgmeta.cpp \
+    src/testsindex.cpp \
+    src/stats.cpp \
+    src/processscheduler.cpp
 
 HEADERS  += \
     src/exportdialog.h \
@@ -30,7 +39,17 @@ HEADERS  += \
     src/paths.h \
     src/settings.h \
     src/backendwidget.h \
-    src/imagecache.h
+    src/imagecache.h \
+    src/batch.h \
+    src/diffkernel.h \
+    src/renderworker.h \
+    src/canceltoken.h \
+    src/imagepack.h \
+    src/cachewriter.h \
+    src/svgmeta.h \
+    src/testsindex.h \
+    src/stats.h \
+    src/processscheduler.h
 
 FORMS    += \
     src/exportdialog.ui \
@@ -40,3 +59,12 @@ FORMS    += \
 DEFINES += SRCDIR=\\\"$$PWD/\\\"
 
 RESOURCES += icons.qrc
+
+# Used to read SVGZ files.
+# Qt has its own copy of zlib on platforms without a system one, like Windows.
+qtConfig(system-zlib) {
+    LIBS += -lz
+} else {
+    QT += zlib-private
+    DEFINES += USE_QT_ZLIB
+}